@@ -0,0 +1,141 @@
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include "arena.h"
+
+Arena::Arena(size_t capacity) : data_(nullptr), capacity_(capacity), used_(0), overflow_(nullptr), overflow_bytes_(0), peak_(0)
+{
+	if (capacity_) data_ = (unsigned char*)malloc(capacity_);
+}
+
+Arena::~Arena()
+{
+	while (overflow_)
+	{
+		Overflow* next = overflow_->next;
+		free(overflow_);
+		overflow_ = next;
+	}
+	free(data_);
+}
+
+void* Arena::alloc(size_t bytes, size_t align)
+{
+	size_t start = (used_ + align - 1) & ~(align - 1);
+	if (start + bytes <= capacity_)
+	{
+		used_ = start + bytes;
+		peak_ = std::max(peak_, used_ + overflow_bytes_);
+		return data_ + start;
+	}
+
+	// frame grew past the block : chain a dedicated one, it is folded in on reset()
+	assert(!heap_forbidden() && "arena grew inside the frame loop");
+	size_t header = (sizeof(Overflow) + align - 1) & ~(align - 1);
+	Overflow* block = (Overflow*)malloc(header + bytes);
+	if (!block) throw std::bad_alloc();
+	block->next = overflow_;
+	block->size = header + bytes;
+	overflow_ = block;
+	overflow_bytes_ += block->size;
+	peak_ = std::max(peak_, used_ + overflow_bytes_);
+	return (unsigned char*)block + header;
+}
+
+void Arena::release(size_t used, Overflow* overflow)
+{
+	while (overflow_ != overflow)
+	{
+		Overflow* next = overflow_->next;
+		overflow_bytes_ -= overflow_->size;
+		free(overflow_);
+		overflow_ = next;
+	}
+	used_ = used;
+}
+
+void Arena::reset()
+{
+	release(0, nullptr);
+	if (peak_ > capacity_)
+	{   // resize once so the same frame fits in a single block next time
+		free(data_);
+		capacity_ = peak_ + peak_ / 2;
+		data_ = (unsigned char*)malloc(capacity_);
+		if (!data_) throw std::bad_alloc();
+	}
+	peak_ = 0;
+}
+
+size_t Arena::capacity() { return capacity_; }
+
+// the frame arena of one thread, linked into a list so reset_frame() reaches every thread's
+struct ThreadArena
+{
+	Arena arena;
+	ThreadArena* next;
+	ThreadArena();
+	~ThreadArena();
+};
+
+static std::mutex thread_arenas_mutex;
+static ThreadArena* thread_arenas = nullptr;
+
+ThreadArena::ThreadArena() : arena(64 * 1024) // room for the rasterizer's row buffers before the first reset
+{
+	std::lock_guard<std::mutex> lock(thread_arenas_mutex);
+	next = thread_arenas;
+	thread_arenas = this;
+}
+
+ThreadArena::~ThreadArena()
+{
+	std::lock_guard<std::mutex> lock(thread_arenas_mutex);
+	ThreadArena** link = &thread_arenas;
+	while (*link != this) link = &(*link)->next;
+	*link = next;
+}
+
+Arena& frame_arena()
+{
+	static thread_local ThreadArena local;
+	return local.arena;
+}
+
+void reset_frame()
+{
+	std::lock_guard<std::mutex> lock(thread_arenas_mutex);
+	for (ThreadArena* a = thread_arenas; a; a = a->next) a->arena.reset();
+}
+
+static std::atomic<int> no_malloc_scopes(0);
+
+NoMallocScope::NoMallocScope(bool active) : active_(active) { if (active_) no_malloc_scopes++; }
+
+NoMallocScope::~NoMallocScope() { if (active_) no_malloc_scopes--; }
+
+bool heap_forbidden() { return no_malloc_scopes > 0; }
+
+#ifdef _DEBUG
+// every operator new in the program goes through here in debug builds
+void* operator new(size_t n)
+{
+	assert(!heap_forbidden() && "heap allocation inside the frame loop");
+	void* p = malloc(n ? n : 1);
+	if (!p) throw std::bad_alloc();
+	return p;
+}
+
+void* operator new[](size_t n) { return operator new(n); }
+
+void operator delete(void* p) noexcept { free(p); }
+
+void operator delete[](void* p) noexcept { free(p); }
+
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+void operator delete[](void* p, size_t) noexcept { free(p); }
+#endif
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+
+// linear allocator : alloc() bumps a pointer, reset() drops everything at once.
+// when a frame outgrows the block, extra blocks are chained and folded into one
+// bigger block on the next reset(), so a steady frame loop never touches the heap
+class Arena
+{
+private:
+	struct Overflow { Overflow* next; size_t size; };
+	unsigned char* data_;
+	size_t capacity_;
+	size_t used_;
+	Overflow* overflow_;     // chained blocks (header first) taken since the last reset
+	size_t overflow_bytes_;
+	size_t peak_;            // most bytes live at once since the last reset
+
+	void release(size_t used, Overflow* overflow);
+
+public:
+	Arena(size_t capacity = 0);
+	~Arena();
+	void* alloc(size_t bytes, size_t align = 16);
+	template <typename T> T* alloc(int n) { return (T*)alloc(sizeof(T) * n, alignof(T)); }
+	void reset();
+	size_t capacity();
+
+	// scratch : what is allocated while a Scope lives is given back when it ends, so per-call
+	// buffers (one per triangle) size the arena by their peak rather than their sum
+	class Scope
+	{
+	public:
+		Scope(Arena& arena) : arena_(arena), used_(arena.used_), overflow_(arena.overflow_) {}
+		~Scope() { arena_.release(used_, overflow_); }
+	private:
+		Arena& arena_;
+		size_t used_;
+		Overflow* overflow_;
+	};
+};
+
+// per-frame transient data : every thread has its own arena, so buffers replayed on several
+// threads never share one. reset_frame() rewinds all of them, call it between frames only
+// (no thread drawing). O(1) per arena once the frame size is stable
+Arena& frame_arena();
+void reset_frame();
+
+// debug builds (_DEBUG) assert that no heap allocation happens while a NoMallocScope is alive
+struct NoMallocScope
+{
+	NoMallocScope(bool active = true);
+	~NoMallocScope();
+private:
+	bool active_;
+};
+bool heap_forbidden();
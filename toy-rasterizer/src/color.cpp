@@ -0,0 +1,198 @@
+#include <algorithm>
+#include <cstring>
+#include "color.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define COLOR_SSE2
+#endif
+
+// x * y / 255 rounded, exact for x, y in [0, 255]
+static inline unsigned int mul255(unsigned int x, unsigned int y)
+{
+	unsigned int t = x * y + 128;
+	return (t + (t >> 8)) >> 8;
+}
+
+#ifdef COLOR_SSE2
+// the same on 16 bit lanes, products stay below 2^16
+static inline __m128i mul255(__m128i x, __m128i y)
+{
+	__m128i t = _mm_add_epi16(_mm_mullo_epi16(x, y), _mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+// 4 pixels in, 4 pixels out, f works on the two halves widened to 16 bit lanes
+template <class F>
+static inline __m128i widened(__m128i a, __m128i b, F f)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i lo = f(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+	__m128i hi = f(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+	return _mm_packus_epi16(lo, hi); // saturates
+}
+#endif
+
+void color_modulate(Color32* dst, const Color32* src, unsigned int scale, int n)
+{
+	int i = 0;
+#ifdef COLOR_SSE2
+	const __m128i s = _mm_set1_epi16((short)scale);
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+		v = widened(v, v, [&](__m128i x, __m128i) { return _mm_srli_epi16(_mm_mullo_epi16(x, s), 8); });
+		_mm_storeu_si128((__m128i*)(dst + i), v);
+	}
+#endif
+	for (; i < n; i++) dst[i] = modulate(src[i], scale);
+}
+
+void color_multiply(Color32* dst, const Color32* a, const Color32* b, int n)
+{
+	int i = 0;
+#ifdef COLOR_SSE2
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128i va = _mm_loadu_si128((const __m128i*)(a + i)), vb = _mm_loadu_si128((const __m128i*)(b + i));
+		_mm_storeu_si128((__m128i*)(dst + i), widened(va, vb, [](__m128i x, __m128i y) { return mul255(x, y); }));
+	}
+#endif
+	for (; i < n; i++) dst[i] = multiply(a[i], b[i]);
+}
+
+void color_add(Color32* dst, const Color32* a, const Color32* b, int n)
+{
+	int i = 0;
+#ifdef COLOR_SSE2
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128i va = _mm_loadu_si128((const __m128i*)(a + i)), vb = _mm_loadu_si128((const __m128i*)(b + i));
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_adds_epu8(va, vb));
+	}
+#endif
+	for (; i < n; i++) dst[i] = add(a[i], b[i]);
+}
+
+void color_lerp(Color32* dst, const Color32* a, const Color32* b, unsigned int t, int n)
+{
+	int i = 0;
+#ifdef COLOR_SSE2
+	const __m128i wa = _mm_set1_epi16((short)(256 - t)), wb = _mm_set1_epi16((short)t);
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128i va = _mm_loadu_si128((const __m128i*)(a + i)), vb = _mm_loadu_si128((const __m128i*)(b + i));
+		__m128i v = widened(va, vb, [&](__m128i x, __m128i y)
+		{   // floor per term like the scalar version, the sum never exceeds 255
+			return _mm_add_epi16(_mm_srli_epi16(_mm_mullo_epi16(x, wa), 8), _mm_srli_epi16(_mm_mullo_epi16(y, wb), 8));
+		});
+		_mm_storeu_si128((__m128i*)(dst + i), v);
+	}
+#endif
+	for (; i < n; i++) dst[i] = lerp(a[i], b[i], t);
+}
+
+// one pixel of blend_span(), the scalar reference of the SIMD loop
+template <int MODE>
+static inline Color32 blend(Color32 d, Color32 s)
+{
+	if (MODE == BLEND_NONE) return s;
+	const unsigned int a = s >> 24, ia = 255 - a;
+	Color32 out = 0;
+	for (int i = 0; i < 32; i += 8)
+	{
+		unsigned int sc = (s >> i) & 0xff, dc = (d >> i) & 0xff, c;
+		bool alpha = i == 24;
+		if (MODE == BLEND_OVER) c = mul255(sc, alpha ? 255 : a) + mul255(dc, ia);
+		else if (MODE == BLEND_ADD) c = dc + (alpha ? 0 : mul255(sc, a));
+		else c = sc + mul255(dc, ia);
+		out |= std::min(c, 255u) << i;
+	}
+	return out;
+}
+
+// packed destination, blended in place where mask is set
+template <int MODE>
+static void blend_span(Color32* dst, const Color32* src, const unsigned char* mask, int n)
+{
+	int i = 0;
+#ifdef COLOR_SSE2
+	const __m128i alpha_lanes = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0); // a of both pixels of a widened half
+	const __m128i ones = _mm_set1_epi16(255);
+	for (; i + 4 <= n; i += 4)
+	{
+		int m4;
+		memcpy(&m4, mask + i, 4);
+		if (!m4) continue;
+		__m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+		__m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+		__m128i out = s;
+		if (MODE != BLEND_NONE)
+		{
+			out = widened(s, d, [&](__m128i sc, __m128i dc)
+			{
+				__m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(sc, 0xff), 0xff); // a broadcast over its pixel
+				__m128i ia = _mm_sub_epi16(ones, a);
+				if (MODE == BLEND_OVER) return _mm_add_epi16(mul255(sc, _mm_or_si128(a, _mm_and_si128(alpha_lanes, ones))), mul255(dc, ia));
+				if (MODE == BLEND_ADD) return _mm_add_epi16(dc, mul255(sc, _mm_andnot_si128(alpha_lanes, a)));
+				return _mm_add_epi16(sc, mul255(dc, ia));
+			});
+		}
+		// mask bytes 0 / 0xff, widened to one 32 bit lane per pixel
+		__m128i m = _mm_cvtsi32_si128(m4);
+		m = _mm_unpacklo_epi8(m, m);
+		m = _mm_unpacklo_epi16(m, m);
+		m = _mm_cmpeq_epi32(m, _mm_setzero_si128());
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_or_si128(_mm_andnot_si128(m, out), _mm_and_si128(m, d)));
+	}
+#endif
+	for (; i < n; i++)
+	{
+		if (mask[i]) dst[i] = blend<MODE>(dst[i], src[i]);
+	}
+}
+
+static void blend_span(Color32* dst, const Color32* src, const unsigned char* mask, int n, BlendMode mode)
+{
+	switch (mode)
+	{
+	case BLEND_OVER: blend_span<BLEND_OVER>(dst, src, mask, n); break;
+	case BLEND_ADD: blend_span<BLEND_ADD>(dst, src, mask, n); break;
+	case BLEND_PREMULTIPLIED: blend_span<BLEND_PREMULTIPLIED>(dst, src, mask, n); break;
+	default: blend_span<BLEND_NONE>(dst, src, mask, n); break;
+	}
+}
+
+void merge_row(unsigned char* dst, int xstride, int bytespp, const Color32* src, const unsigned char* mask, int n, BlendMode mode)
+{
+	if (bytespp == TGAImage::RGBA && xstride == TGAImage::RGBA)
+	{
+		blend_span((Color32*)dst, src, mask, n, mode);
+		return;
+	}
+	if (mode == BLEND_NONE)
+	{   // nothing to read back
+		for (int i = 0; i < n; i++)
+		{
+			if (mask[i]) memcpy(dst + i * xstride, &src[i], bytespp);
+		}
+		return;
+	}
+	const int CHUNK = 64;
+	Color32 packed[CHUNK];
+	for (int first = 0; first < n; first += CHUNK)
+	{
+		const int count = std::min(CHUNK, n - first);
+		unsigned char* row = dst + first * xstride;
+		for (int i = 0; i < count; i++)
+		{
+			packed[i] = 0xff000000; // no alpha channel : opaque
+			memcpy(&packed[i], row + i * xstride, bytespp);
+		}
+		blend_span(packed, src + first, mask + first, count, mode);
+		for (int i = 0; i < count; i++)
+		{
+			if (mask[first + i]) memcpy(row + i * xstride, &packed[i], bytespp);
+		}
+	}
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "tgaimage.h"
+
+// one pixel packed in 32 bits, bytes b, g, r, a from the low end : the order of TGA pixels and of
+// TGAColor::raw, so TGAColor::val converts for free. channels are 8 bit fixed point, 255 = 1.0
+typedef unsigned int Color32;
+
+inline Color32 color32(unsigned char r, unsigned char g, unsigned char b, unsigned char a = 255)
+{
+	return b | g << 8 | r << 16 | (Color32)a << 24;
+}
+
+inline Color32 color32(const TGAColor& c) { return c.val; } // colors read from images without alpha have a = 255
+
+inline TGAColor tgacolor(Color32 c, int bytespp = TGAImage::RGBA) { return TGAColor((int)c, bytespp); }
+
+// every channel * scale / 256, scale in [0, 256]. two channels per multiply
+inline Color32 modulate(Color32 c, unsigned int scale)
+{
+	Color32 rb = ((c & 0x00ff00ff) * scale >> 8) & 0x00ff00ff;
+	Color32 ag = ((c >> 8) & 0x00ff00ff) * scale & 0xff00ff00;
+	return rb | ag;
+}
+
+// a * b / 255 per channel, rounded
+inline Color32 multiply(Color32 a, Color32 b)
+{
+	Color32 c = 0;
+	for (int i = 0; i < 32; i += 8)
+	{
+		unsigned int t = ((a >> i) & 0xff) * ((b >> i) & 0xff) + 128;
+		c |= ((t + (t >> 8)) >> 8) << i;
+	}
+	return c;
+}
+
+// per channel, saturating
+inline Color32 add(Color32 a, Color32 b)
+{
+	Color32 rb = (a & 0x00ff00ff) + (b & 0x00ff00ff);
+	Color32 ag = ((a >> 8) & 0x00ff00ff) + ((b >> 8) & 0x00ff00ff);
+	rb |= (rb & 0x01000100) - ((rb & 0x01000100) >> 8); // a carry out of a channel fills it with ones
+	ag |= (ag & 0x01000100) - ((ag & 0x01000100) >> 8);
+	return (rb & 0x00ff00ff) | (ag & 0x00ff00ff) << 8;
+}
+
+// a + (b - a) * t / 256, t in [0, 256]
+inline Color32 lerp(Color32 a, Color32 b, unsigned int t)
+{
+	return modulate(a, 256 - t) + modulate(b, t); // no channel carries : the weights sum to 256
+}
+
+// row kernels over n packed pixels, SSE2 four at a time where available. dst may alias a source
+void color_modulate(Color32* dst, const Color32* src, unsigned int scale, int n);
+void color_multiply(Color32* dst, const Color32* a, const Color32* b, int n);
+void color_add(Color32* dst, const Color32* a, const Color32* b, int n);
+void color_lerp(Color32* dst, const Color32* a, const Color32* b, unsigned int t, int n);
+
+// output merger. source alpha is the fragment's a, images without alpha count as opaque destinations
+enum BlendMode
+{
+	BLEND_NONE,          // overwrite
+	BLEND_OVER,          // src * a + dst * (1 - a)
+	BLEND_ADD,           // dst + src * a, saturating
+	BLEND_PREMULTIPLIED  // src + dst * (1 - a), src already carries its alpha
+};
+
+// merges n fragments into a framebuffer row : dst points at the first pixel, xstride bytes apart
+// (any TGAImage view), pixels whose mask byte is 0 are left alone. 32 bit contiguous rows are blended
+// in place, others through a packed copy of a chunk of the row
+void merge_row(unsigned char* dst, int xstride, int bytespp, const Color32* src, const unsigned char* mask, int n, BlendMode mode);
@@ -0,0 +1,267 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include "compare.h"
+#include "workers.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define COMPARE_SSE2
+#endif
+
+static const int SSIM_BLOCK = 8; // also the rows per job, so a job owns whole SSIM blocks
+
+// one worker's share of the sums
+struct Partial
+{
+	long long sum[4];
+	long long sq; // sum of squared errors, every channel
+	int max[4];
+	long long differing;
+	double ssim;
+	long long blocks;
+};
+
+static int luma(const unsigned char* p, int bpp)
+{
+	return bpp == TGAImage::GRAYSCALE ? p[0] : (p[0] + 2 * p[1] + p[2] + 2) / 4; // b + 2g + r
+}
+
+// n pixels of two rows, any strides
+static void diff_pixels(const unsigned char* pa, int sa, const unsigned char* pb, int sb, int n, int bpp, int tolerance, Partial& part)
+{
+	for (int i = 0; i < n; i++, pa += sa, pb += sb)
+	{
+		bool differs = false;
+		for (int c = 0; c < bpp; c++)
+		{
+			int d = std::abs(pa[c] - pb[c]);
+			part.sum[c] += d;
+			part.sq += d * d;
+			part.max[c] = std::max(part.max[c], d);
+			differs = differs || d > tolerance;
+		}
+		if (differs) part.differing++;
+	}
+}
+
+// contiguous rows : 16 pixels are bpp vectors of 16 bytes, byte k of vector j is channel (16 j + k) % bpp
+static void diff_row(const unsigned char* pa, const unsigned char* pb, int n, int bpp, int tolerance, Partial& part)
+{
+	int x = 0;
+#ifdef COMPARE_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i tol = _mm_set1_epi8((char)std::min(255, tolerance));
+	__m128i vmax[4], vsum[4][4], vsq = zero;
+	for (int j = 0; j < bpp; j++)
+	{
+		vmax[j] = zero;
+		for (int q = 0; q < 4; q++) vsum[j][q] = zero;
+	}
+	for (; x + 16 <= n; x += 16)
+	{
+		unsigned long long over = 0; // one bit per byte above the tolerance
+		for (int j = 0; j < bpp; j++)
+		{
+			__m128i va = _mm_loadu_si128((const __m128i*)(pa + x * bpp + j * 16));
+			__m128i vb = _mm_loadu_si128((const __m128i*)(pb + x * bpp + j * 16));
+			__m128i d = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+			vmax[j] = _mm_max_epu8(vmax[j], d);
+			__m128i lo = _mm_unpacklo_epi8(d, zero), hi = _mm_unpackhi_epi8(d, zero);
+			vsum[j][0] = _mm_add_epi32(vsum[j][0], _mm_unpacklo_epi16(lo, zero));
+			vsum[j][1] = _mm_add_epi32(vsum[j][1], _mm_unpackhi_epi16(lo, zero));
+			vsum[j][2] = _mm_add_epi32(vsum[j][2], _mm_unpacklo_epi16(hi, zero));
+			vsum[j][3] = _mm_add_epi32(vsum[j][3], _mm_unpackhi_epi16(hi, zero));
+			vsq = _mm_add_epi32(vsq, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+			int within = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(d, tol), zero));
+			over |= (unsigned long long)(~within & 0xffff) << (j * 16);
+		}
+		if (over)
+		{
+			for (int p = 0; p < 16; p++) part.differing += (over >> (p * bpp) & ((1u << bpp) - 1)) != 0;
+		}
+	}
+
+	// fold the lanes back into channels
+	for (int j = 0; j < bpp; j++)
+	{
+		unsigned char m[16];
+		_mm_storeu_si128((__m128i*)m, vmax[j]);
+		for (int k = 0; k < 16; k++) part.max[(j * 16 + k) % bpp] = std::max(part.max[(j * 16 + k) % bpp], (int)m[k]);
+		for (int q = 0; q < 4; q++)
+		{
+			int s[4];
+			_mm_storeu_si128((__m128i*)s, vsum[j][q]);
+			for (int l = 0; l < 4; l++) part.sum[(j * 16 + q * 4 + l) % bpp] += s[l];
+		}
+	}
+	int sq[4];
+	_mm_storeu_si128((__m128i*)sq, vsq);
+	part.sq += (long long)sq[0] + sq[1] + sq[2] + sq[3];
+#endif
+	diff_pixels(pa + x * bpp, bpp, pb + x * bpp, bpp, n - x, bpp, tolerance, part);
+}
+
+// structural similarity of one block of luma
+static double ssim_block(TGAImage& a, TGAImage& b, int x0, int y0, int x1, int y1)
+{
+	const double C1 = (0.01 * 255) * (0.01 * 255), C2 = (0.03 * 255) * (0.03 * 255);
+	const int bpp = a.get_bytespp(), sa = a.get_xstride(), sb = b.get_xstride();
+	double ma = 0, mb = 0, va = 0, vb = 0, cov = 0;
+	int n = (x1 - x0) * (y1 - y0);
+	for (int y = y0; y < y1; y++)
+	{
+		const unsigned char* pa = a.pixel(x0, y);
+		const unsigned char* pb = b.pixel(x0, y);
+		for (int x = x0; x < x1; x++, pa += sa, pb += sb)
+		{
+			double la = luma(pa, bpp), lb = luma(pb, bpp);
+			ma += la;
+			mb += lb;
+			va += la * la;
+			vb += lb * lb;
+			cov += la * lb;
+		}
+	}
+	ma /= n;
+	mb /= n;
+	va = va / n - ma * ma;
+	vb = vb / n - mb * mb;
+	cov = cov / n - ma * mb;
+	return ((2 * ma * mb + C1) * (2 * cov + C2)) / ((ma * ma + mb * mb + C1) * (va + vb + C2));
+}
+
+bool compare(TGAImage& a, TGAImage& b, ImageDiff& diff, int tolerance, TGAImage* heatmap)
+{
+	const int width = a.get_width(), height = a.get_height(), bpp = a.get_bytespp();
+	if (!a.buffer() || !b.buffer() || width != b.get_width() || height != b.get_height() || bpp != b.get_bytespp())
+	{
+		std::cerr << "compare : images differ in size or format" << std::endl;
+		return false;
+	}
+	if (heatmap) *heatmap = TGAImage(width, height, TGAImage::RGB);
+	const bool contiguous = a.get_xstride() == bpp && b.get_xstride() == bpp;
+
+	Partial parts[MAX_WORKERS];
+	memset(parts, 0, sizeof(parts));
+	const int stripes = (height + SSIM_BLOCK - 1) / SSIM_BLOCK;
+	std::atomic<int> next_stripe(0);
+	auto worker = [&](int t)
+	{
+		Partial& part = parts[t];
+		for (int stripe; (stripe = next_stripe++) < stripes;)
+		{
+			int y0 = stripe * SSIM_BLOCK, y1 = std::min(height, y0 + SSIM_BLOCK);
+			for (int y = y0; y < y1; y++)
+			{
+				if (contiguous) diff_row(a.pixel(0, y), b.pixel(0, y), width, bpp, tolerance, part);
+				else diff_pixels(a.pixel(0, y), a.get_xstride(), b.pixel(0, y), b.get_xstride(), width, bpp, tolerance, part);
+				if (!heatmap) continue;
+				for (int x = 0; x < width; x++)
+				{
+					const unsigned char* pa = a.pixel(x, y);
+					const unsigned char* pb = b.pixel(x, y);
+					int d = 0;
+					for (int c = 0; c < bpp; c++) d = std::max(d, std::abs(pa[c] - pb[c]));
+					if (d > tolerance) heatmap->set(x, y, TGAColor((unsigned char)std::min(255, 64 + d * 4), 0, 0));
+					else
+					{
+						unsigned char l = (unsigned char)(luma(pa, bpp) / 4);
+						heatmap->set(x, y, TGAColor(l, l, l));
+					}
+				}
+			}
+			for (int x = 0; x < width; x += SSIM_BLOCK)
+			{
+				part.ssim += ssim_block(a, b, x, y0, std::min(width, x + SSIM_BLOCK), y1);
+				part.blocks++;
+			}
+		}
+	};
+	run_workers(worker);
+
+	Partial total;
+	memset(&total, 0, sizeof(total));
+	for (int t = 0; t < MAX_WORKERS; t++)
+	{
+		for (int c = 0; c < 4; c++)
+		{
+			total.sum[c] += parts[t].sum[c];
+			total.max[c] = std::max(total.max[c], parts[t].max[c]);
+		}
+		total.sq += parts[t].sq;
+		total.differing += parts[t].differing;
+		total.ssim += parts[t].ssim;
+		total.blocks += parts[t].blocks;
+	}
+
+	const double npixels = (double)width * height;
+	diff.channels = bpp;
+	for (int c = 0; c < 4; c++)
+	{
+		diff.max_error[c] = c < bpp ? total.max[c] : 0;
+		diff.mean_error[c] = c < bpp ? total.sum[c] / npixels : 0;
+	}
+	double mse = total.sq / (npixels * bpp);
+	diff.psnr = mse > 0 ? 10 * std::log10(255.0 * 255.0 / mse) : std::numeric_limits<double>::infinity();
+	diff.ssim = total.blocks ? total.ssim / total.blocks : 1.0;
+	diff.differing = total.differing;
+	return true;
+}
+
+void print_diff(const ImageDiff& diff)
+{
+	const char* names[4] = { "b", "g", "r", "a" };
+	for (int c = 0; c < diff.channels; c++)
+	{
+		std::cout << (diff.channels == 1 ? "y" : names[c]) << " : max " << diff.max_error[c] << " mean " << diff.mean_error[c] << "\n";
+	}
+	std::cout << "psnr " << diff.psnr << " dB, ssim " << diff.ssim << ", " << diff.differing << " pixels differ" << std::endl;
+}
+
+int compare_main(int argc, char** argv)
+{
+	if (argc < 3)
+	{
+		std::cerr << "usage : compare a.tga b.tga [--tolerance n] [--max n] [--psnr db] [--ssim s] [--differing n] [--heatmap out.tga]" << std::endl;
+		return 2;
+	}
+	int tolerance = 0;
+	int max_error = -1;
+	double min_psnr = -1, min_ssim = -1;
+	long long max_differing = -1;
+	const char* heatmap_file = nullptr;
+	for (int i = 3; i + 1 < argc; i += 2)
+	{
+		if (!strcmp(argv[i], "--tolerance")) tolerance = atoi(argv[i + 1]);
+		else if (!strcmp(argv[i], "--max")) max_error = atoi(argv[i + 1]);
+		else if (!strcmp(argv[i], "--psnr")) min_psnr = atof(argv[i + 1]);
+		else if (!strcmp(argv[i], "--ssim")) min_ssim = atof(argv[i + 1]);
+		else if (!strcmp(argv[i], "--differing")) max_differing = atoll(argv[i + 1]);
+		else if (!strcmp(argv[i], "--heatmap")) heatmap_file = argv[i + 1];
+		else
+		{
+			std::cerr << "unknown option " << argv[i] << std::endl;
+			return 2;
+		}
+	}
+
+	TGAImage a, b, heatmap;
+	if (!a.read_tga_file(argv[1]) || !b.read_tga_file(argv[2])) return 2;
+	ImageDiff diff;
+	if (!compare(a, b, diff, tolerance, heatmap_file ? &heatmap : nullptr)) return 2;
+	print_diff(diff);
+	if (heatmap_file) heatmap.write_tga_file(heatmap_file);
+
+	bool pass = true;
+	for (int c = 0; c < diff.channels; c++) pass = pass && (max_error < 0 || diff.max_error[c] <= max_error);
+	pass = pass && (min_psnr < 0 || diff.psnr >= min_psnr);
+	pass = pass && (min_ssim < 0 || diff.ssim >= min_ssim);
+	pass = pass && (max_differing < 0 || diff.differing <= max_differing);
+	std::cout << (pass ? "PASS" : "FAIL") << std::endl;
+	return pass ? 0 : 1;
+}
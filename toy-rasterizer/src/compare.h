@@ -0,0 +1,24 @@
+#pragma once
+
+#include "tgaimage.h"
+
+struct ImageDiff
+{
+	int channels;          // bytes per pixel of the compared images, raw order (b, g, r, a)
+	int max_error[4];      // per channel, 0..255
+	double mean_error[4];  // per channel
+	double psnr;           // dB over every channel, infinity when identical
+	double ssim;           // mean over 8x8 luma blocks, 1 when identical
+	long long differing;   // pixels with some channel off by more than the tolerance
+};
+
+// a and b must have the same size and format (views are fine). kernels are SSE2 where rows are
+// contiguous, rows are spread over the worker threads. heatmap (optional) is resized to RGB :
+// dimmed luma of a where the pixels match, red scaled by the error where they differ
+bool compare(TGAImage& a, TGAImage& b, ImageDiff& diff, int tolerance = 0, TGAImage* heatmap = nullptr);
+
+void print_diff(const ImageDiff& diff);
+
+// compare a.tga b.tga [--tolerance n] [--max n] [--psnr db] [--ssim s] [--differing n] [--heatmap out.tga]
+// prints the report, returns the exit code : 0 within every given threshold, 1 outside, 2 bad input
+int compare_main(int argc, char** argv);
@@ -0,0 +1,337 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <vector>
+#include "distributed.h"
+
+#ifndef _WIN32
+#include <csignal>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// worker -> coordinator, followed by w * h * bytespp pixels (rows bottom up) when status is 0
+struct TileReply
+{
+	TileRequest tile;
+	int status;
+	int bytespp;
+	long long micros; // render time, the cost estimate for the next frame
+};
+
+typedef std::chrono::steady_clock Clock;
+
+#ifdef _WIN32
+
+bool render_distributed(const DistributedOptions& opt, int width, int height, int bytespp, int nframes,
+	void (*frame)(void*, int, TGAImage&), void* ctx)
+{
+	std::cerr << "distributed rendering needs fork / pipes, not available on this platform" << std::endl;
+	return false;
+}
+
+int serve_tiles(int argc, char** argv, int bytespp, bool (*render)(void*, const TileRequest&, TGAImage&), void* ctx)
+{
+	return 1;
+}
+
+#else
+
+// whole buffers, through EINTR and short transfers. false : closed or broken pipe
+static bool read_full(int fd, void* buf, size_t n)
+{
+	char* p = (char*)buf;
+	while (n > 0)
+	{
+		ssize_t r = read(fd, p, n);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) return false;
+		p += r;
+		n -= r;
+	}
+	return true;
+}
+
+static bool write_full(int fd, const void* buf, size_t n)
+{
+	const char* p = (const char*)buf;
+	while (n > 0)
+	{
+		ssize_t r = write(fd, p, n);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) return false;
+		p += r;
+		n -= r;
+	}
+	return true;
+}
+
+int serve_tiles(int argc, char** argv, int bytespp, bool (*render)(void*, const TileRequest&, TGAImage&), void* ctx)
+{
+	// worker <request fd> <reply fd> <fail every>
+	if (argc < 4)
+	{
+		std::cerr << "worker : started without its pipes" << std::endl;
+		return 1;
+	}
+	const int in = atoi(argv[1]), out = atoi(argv[2]), fail_every = atoi(argv[3]);
+	std::vector<unsigned char> rows;
+	TileRequest req;
+	for (int served = 1; read_full(in, &req, sizeof(req)) && req.frame >= 0; served++)
+	{
+		if (fail_every > 0 && served % fail_every == 0) abort(); // fault injection, see DistributedOptions
+
+		TileReply reply;
+		reply.tile = req;
+		reply.bytespp = bytespp;
+		TGAImage tile(req.w, req.h, bytespp);
+		Clock::time_point start = Clock::now();
+		reply.status = render(ctx, req, tile) ? 0 : 1;
+		reply.micros = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+		if (!write_full(out, &reply, sizeof(reply))) return 1;
+		if (reply.status) continue;
+		rows.resize((size_t)req.w * req.h * bytespp);
+		for (int y = 0; y < req.h; y++) memcpy(&rows[(size_t)y * req.w * bytespp], tile.pixel(0, y), (size_t)req.w * bytespp);
+		if (!write_full(out, rows.data(), rows.size())) return 1;
+	}
+	return 0;
+}
+
+struct Worker
+{
+	pid_t pid;
+	int to, from;  // request / reply pipe ends, -1 when dead
+	int tile;      // in flight, -1 idle
+	Clock::time_point start;
+};
+
+static bool spawn(Worker& w, const DistributedOptions& opt)
+{
+	int request[2], reply[2];
+	if (pipe(request) < 0) return false;
+	if (pipe(reply) < 0)
+	{
+		close(request[0]);
+		close(request[1]);
+		return false;
+	}
+	const char* program = access("/proc/self/exe", X_OK) == 0 ? "/proc/self/exe" : opt.program;
+	// formatted before fork() : the child only calls async-signal-safe functions until execl
+	char in[16], out[16], fail[16];
+	snprintf(in, sizeof(in), "%d", request[0]);
+	snprintf(out, sizeof(out), "%d", reply[1]);
+	snprintf(fail, sizeof(fail), "%d", opt.fail_every);
+	pid_t pid = program ? fork() : -1;
+	if (pid == 0)
+	{
+		close(request[1]);
+		close(reply[0]);
+		execl(program, program, "worker", in, out, fail, (char*)nullptr);
+		_exit(127);
+	}
+	close(request[0]);
+	close(reply[1]);
+	if (pid < 0)
+	{
+		close(request[1]);
+		close(reply[0]);
+		return false;
+	}
+	// workers spawned later must not hold these, or a dead worker's pipes would never report EOF
+	fcntl(request[1], F_SETFD, FD_CLOEXEC);
+	fcntl(reply[0], F_SETFD, FD_CLOEXEC);
+	w.pid = pid;
+	w.to = request[1];
+	w.from = reply[0];
+	w.tile = -1;
+	return true;
+}
+
+static void retire(Worker& w)
+{
+	if (w.to < 0) return;
+	close(w.to);
+	close(w.from);
+	kill(w.pid, SIGKILL);
+	waitpid(w.pid, nullptr, 0);
+	w.to = w.from = -1;
+	w.tile = -1;
+}
+
+bool render_distributed(const DistributedOptions& opt, int width, int height, int bytespp, int nframes,
+	void (*frame)(void*, int, TGAImage&), void* ctx)
+{
+	const int ts = std::max(1, opt.tile_size);
+	const int tiles_x = (width + ts - 1) / ts, tiles_y = (height + ts - 1) / ts, ntiles = tiles_x * tiles_y;
+	std::vector<Worker> workers(std::max(1, opt.workers));
+	int live = 0;
+	for (Worker& w : workers)
+	{
+		if (spawn(w, opt)) live++;
+		else w.to = w.from = -1;
+	}
+	if (!live)
+	{
+		std::cerr << "distributed : can't start any worker" << std::endl;
+		return false;
+	}
+	void (*sigpipe)(int) = signal(SIGPIPE, SIG_IGN); // a worker dying under a write must not take us down
+
+	std::vector<long long> cost(ntiles, 0);
+	std::vector<int> order(ntiles), attempts(ntiles);
+	std::vector<pollfd> fds;
+	std::vector<Worker*> polled;
+	std::vector<unsigned char> rows;
+	// workers lost in a row without a finished tile, past this we stop replacing them
+	const int max_respawns = (int)workers.size() * std::max(1, opt.max_retries);
+	int respawns = max_respawns;
+	bool ok = true;
+
+	for (int f = 0; f < nframes && ok; f++)
+	{
+		TGAImage image(width, height, bytespp);
+		Clock::time_point frame_start = Clock::now();
+		// costliest first, so a slow tile doesn't start last and leave the others idle
+		for (int i = 0; i < ntiles; i++) order[i] = i;
+		std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return cost[a] > cost[b]; });
+		std::deque<int> queue(order.begin(), order.end());
+		// a tile index to its pixels, for the request and to check the reply against
+		auto rect = [&](int tile)
+		{
+			TileRequest req;
+			req.frame = f;
+			req.x = (tile % tiles_x) * ts;
+			req.y = (tile / tiles_x) * ts;
+			req.w = std::min(ts, width - req.x);
+			req.h = std::min(ts, height - req.y);
+			return req;
+		};
+		std::fill(attempts.begin(), attempts.end(), 0);
+		int done = 0, retried = 0;
+
+		// the in-flight tile of a dead or failed worker is queued again
+		auto requeue = [&](int tile)
+		{
+			if (++attempts[tile] > opt.max_retries)
+			{
+				std::cerr << "distributed : tile " << tile << " of frame " << f << " failed " << attempts[tile] << " times" << std::endl;
+				ok = false;
+			}
+			retried++;
+			queue.push_front(tile);
+		};
+		auto lost = [&](Worker& w)
+		{
+			if (w.tile >= 0) requeue(w.tile);
+			retire(w);
+			live--;
+			if (respawns > 0 && spawn(w, opt))
+			{
+				respawns--;
+				live++;
+			}
+		};
+
+		while (done < ntiles && ok)
+		{
+			if (!live)
+			{
+				std::cerr << "distributed : no worker left" << std::endl;
+				ok = false;
+				break;
+			}
+			for (Worker& w : workers)
+			{
+				if (w.to < 0 || w.tile >= 0 || queue.empty()) continue;
+				int tile = queue.front();
+				queue.pop_front();
+				TileRequest req = rect(tile);
+				w.tile = tile;
+				w.start = Clock::now();
+				if (!write_full(w.to, &req, sizeof(req))) lost(w);
+			}
+
+			fds.clear();
+			polled.clear();
+			for (Worker& w : workers)
+			{
+				if (w.to < 0 || w.tile < 0) continue;
+				pollfd p = { w.from, POLLIN, 0 };
+				fds.push_back(p);
+				polled.push_back(&w);
+			}
+			if (fds.empty()) continue;
+			if (poll(fds.data(), fds.size(), 100) < 0 && errno != EINTR)
+			{
+				std::cerr << "distributed : poll failed" << std::endl;
+				ok = false;
+				break;
+			}
+
+			for (size_t i = 0; i < fds.size() && ok; i++)
+			{
+				Worker& w = *polled[i];
+				if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+				{
+					if (Clock::now() - w.start > std::chrono::milliseconds(opt.timeout_ms)) lost(w); // hung
+					continue;
+				}
+				// the reply's tile only has to match ours : sizes and offsets come from our record, so a
+				// confused worker can't make us write outside the image. out of step, the stream is dropped
+				const TileRequest t = rect(w.tile);
+				TileReply reply;
+				if (!read_full(w.from, &reply, sizeof(reply)) || reply.bytespp != bytespp || reply.tile.frame != t.frame ||
+					reply.tile.x != t.x || reply.tile.y != t.y || reply.tile.w != t.w || reply.tile.h != t.h)
+				{
+					lost(w);
+					continue;
+				}
+				if (reply.status)
+				{
+					requeue(w.tile);
+					w.tile = -1;
+					continue;
+				}
+				rows.resize((size_t)t.w * t.h * bytespp);
+				if (!read_full(w.from, rows.data(), rows.size()))
+				{
+					lost(w);
+					continue;
+				}
+				for (int y = 0; y < t.h; y++) memcpy(image.pixel(t.x, t.y + y), &rows[(size_t)y * t.w * bytespp], (size_t)t.w * bytespp);
+				cost[w.tile] = reply.micros;
+				w.tile = -1;
+				done++;
+				respawns = max_respawns;
+			}
+		}
+		if (!ok) break;
+
+		long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - frame_start).count();
+		std::cout << "frame " << f << " : " << ntiles << " tiles on " << live << " workers, " << retried << " retried, " << ms << " ms" << std::endl;
+		frame(ctx, f, image);
+	}
+
+	TileRequest quit;
+	memset(&quit, 0, sizeof(quit));
+	quit.frame = -1;
+	for (Worker& w : workers)
+	{
+		if (w.to < 0) continue;
+		write_full(w.to, &quit, sizeof(quit));
+		close(w.to);
+		close(w.from);
+		waitpid(w.pid, nullptr, 0);
+	}
+	signal(SIGPIPE, sigpipe);
+	return ok;
+}
+
+#endif
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "tgaimage.h"
+
+// one screen tile of one frame, in pixels (y up like the rasterizer)
+struct TileRequest
+{
+	int frame;
+	int x, y, w, h;
+};
+
+struct DistributedOptions
+{
+	int workers;      // processes, each loads the model on its own
+	int tile_size;    // pixels per tile side
+	int max_retries;  // per tile, on a crash, a timeout or a failed render
+	int timeout_ms;   // a tile taking longer kills its worker
+	int fail_every;   // testing : workers abort() on every n-th tile, 0 never
+	const char* program; // this binary (argv[0]), /proc/self/exe is preferred where it exists
+
+	DistributedOptions() : workers(4), tile_size(128), max_retries(3), timeout_ms(30000), fail_every(0), program(nullptr) {}
+};
+
+// coordinator : frames [0, nframes) of width x height are cut into tiles and rendered by worker processes,
+// `program worker ...` over pipes, kept alive for the whole sequence. idle workers pull the costliest
+// tile left, costs are the render times measured on the previous frame. a tile whose worker crashes,
+// hangs or reports a failure goes back in the queue on a fresh worker, up to max_retries times.
+// frame(ctx, f, image) gets every finished frame in order. false : a tile ran out of retries,
+// or no worker could be started (POSIX only, always false on Windows)
+bool render_distributed(const DistributedOptions& opt, int width, int height, int bytespp, int nframes,
+	void (*frame)(void*, int, TGAImage&), void* ctx);
+
+// worker side, for main() when argv[1] is "worker" (pass argc - 1, argv + 1) : serves tile requests
+// until the coordinator quits. render(ctx, request, tile) fills a w x h tile, the view must be shifted
+// so that screen pixel (x, y) lands on tile pixel (0, 0). returns the process exit code
+int serve_tiles(int argc, char** argv, int bytespp, bool (*render)(void*, const TileRequest&, TGAImage&), void* ctx);
+
+template <class F>
+bool render_distributed(const DistributedOptions& opt, int width, int height, int bytespp, int nframes, F& frame)
+{
+	return render_distributed(opt, width, height, bytespp, nframes, [](void* ctx, int f, TGAImage& image) { (*(F*)ctx)(f, image); }, &frame);
+}
+
+template <class F>
+int serve_tiles(int argc, char** argv, int bytespp, F& render)
+{
+	return serve_tiles(argc, argv, bytespp, [](void* ctx, const TileRequest& t, TGAImage& tile) { return (*(F*)ctx)(t, tile); }, &render);
+}
@@ -7,17 +7,26 @@ template<> template<> Vec3<float>::Vec3(const Vec3<int>& v)
 	: x(v.x), y(v.y), z(v.z) {}
 template<> Vec3<float>::Vec3(Matrix m)
     : x(m[0][0] / m[3][0]), y(m[1][0] / m[3][0]), z(m[2][0] / m[3][0]) {}
+template<> Vec4<float>::Vec4(Matrix m)
+    : x(m[0][0]), y(m[1][0]), z(m[2][0]), w(m[3][0]) {}
 
 
 Matrix::Matrix(int r, int c)
-	: m(std::vector<std::vector<float>>(r, std::vector<float>(c, 0.0f))), rows(r), cols(c) {}
+	: rows(r), cols(c)
+{
+	assert(r > 0 && r <= 4 && c > 0 && c <= 8);
+	for (int i = 0; i < r; i++)
+		for (int j = 0; j < c; j++)
+			m[i][j] = 0.0f;
+}
 
 Matrix::Matrix(Vec3f v)
-    : m(std::vector<std::vector<float>>(4, std::vector<float>(1, 1.0f))), rows(4), cols(1)
+    : rows(4), cols(1)
 {
     m[0][0] = v.x;
     m[1][0] = v.y;
     m[2][0] = v.z;
+    m[3][0] = 1.0f;
 }
 int Matrix::nrows() { return rows; }
 
@@ -33,13 +42,19 @@ Matrix Matrix::identity(int dimensions)
 	return E;
 }
 
-std::vector<float>& Matrix::operator[] (const int i)
+float* Matrix::operator[] (const int i)
+{
+	assert(i >= 0 && i < rows);
+	return m[i];
+}
+
+const float* Matrix::operator[] (const int i) const
 {
 	assert(i >= 0 && i < rows);
 	return m[i];
 }
 
-Matrix Matrix::operator*(const Matrix& a)
+Matrix Matrix::operator*(const Matrix& a) const
 {
 	assert(cols == a.rows);
 	Matrix result(rows, a.cols);
@@ -49,10 +49,24 @@ template <typename T> struct Vec3 {
 	template <typename T> friend std::ostream& operator<<(std::ostream& s, Vec3<T>& v);
 };
 
+template <typename T> struct Vec4 {
+	union
+	{
+		struct { T x, y, z, w; };
+		T raw[4];
+	};
+	Vec4() : x(0), y(0), z(0), w(0) {}
+	Vec4(T _x, T _y, T _z, T _w) : x(_x), y(_y), z(_z), w(_w) {}
+	Vec4(Matrix m); // homogeneous coords, no perspective divide
+
+	inline T& operator[](const int i) { return raw[i]; }
+};
+
 typedef Vec2<float> Vec2f;
 typedef Vec2<int>   Vec2i;
 typedef Vec3<float> Vec3f;
 typedef Vec3<int>   Vec3i;
+typedef Vec4<float> Vec4f;
 
 template<> template<> Vec3<int>::Vec3(const Vec3<float>& v);
 template<> template<> Vec3<float>::Vec3(const Vec3<int>& v);
@@ -75,7 +89,7 @@ template <typename T> Vec3<T> cross(Vec3<T> v1, Vec3<T> v2) {
 class Matrix
 {
 private:
-	std::vector<std::vector<float>> m;
+	float m[4][8]; // fixed storage, wide enough for the augmented matrix of inverse() : no heap per multiply
 	int rows, cols;
 
 public:
@@ -86,8 +100,9 @@ public:
 
 	static Matrix identity(int dimensions);
 
-	std::vector<float>& operator[](const int i); 
-	Matrix operator*(const Matrix& a);
+	float* operator[](const int i); 
+	const float* operator[](const int i) const;
+	Matrix operator*(const Matrix& a) const;
 
 	Matrix transpose();
 	Matrix inverse();
@@ -1,8 +1,15 @@
 #include <cmath>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <limits>
+#include <vector>
+#include "arena.h"
+#include "compare.h"
+#include "distributed.h"
 #include "model.h"
 #include "myGL.h"
+#include "resample.h"
 
 const int width = 800;
 const int height = 800;
@@ -11,88 +18,371 @@ Vec3f light_dir = Vec3f(1, -1, 1).normalize();
 Vec3f camera(1, 1, 3);
 Vec3f center(0, 0, 0);
 
-Model* model = nullptr;
+const bool shadow_pass = false; // depth pass from light_dir, shadows in Shader
+const bool zprepass = true; // depth first, then one fragment() per pixel
+const int lod_levels = 6; // LOD chain picked per frame by lod_pixel_error, 1 : full mesh only
+const bool lod_cache = false; // keep the LOD chain in obj\african_head.lod across runs (written by the coordinator only)
+const bool quantized_vertices = false; // 16 bit positions / uvs, octahedral normals, 16 bit indices
+const int texture_budget_kb = 0; // > 0 : page the diffuse map in tiles, at most this much of it resident
+const float lod_pixel_error = 0.5f; // LOD is picked so that no removed vertex lies farther than this from its surface
+const bool wireframe_overlay = false; // hidden-line wireframe on top of the fill
+const int instance_grid = 0; // > 0 : draw an instance_grid x instance_grid field of copies instead
+const float shadow_bias = 5.0f; // in zbuffer units (0..255)
+const int thumbnail_sizes[] = { 400, 200, 100 }; // written next to the frame, Lanczos filtered
+const int shading_rate = 1; // 2 or 4 : coarse shading for previews, one fragment() per block
+const int adaptive_shading = 0; // > 0 : per-tile rate from the previous frame, luma step threshold (0..255)
+const bool lookdev = false; // orbit the light every frame, relighting the G-buffer of the first one
+const int poster_size = 0; // > 0 : also stream a poster_size wide render to output\poster.tga, band by band
+const int poster_band = 256; // rows per band, bounds the poster's memory
+const int distributed_workers = 0; // > 0 : render distributed_frames in tiles on this many worker processes instead
+const int distributed_tile = 128;
+const int distributed_frames = 1; // the camera orbits the model over the sequence, output\frame_000.tga ...
+const int distributed_fail_every = 0; // testing : workers crash on every n-th tile, the coordinator retries
+const BlendMode model_blend = BLEND_NONE; // BLEND_OVER etc. : the head is translucent, model_alpha in 0..255
+const int model_alpha = 255; // with zprepass off every layer of the mesh blends (depth is tested, not written)
+const int frames = 3; // frames after the first must not touch the heap (asserted in _DEBUG builds)
 
 struct Shader : IShader
 {
-    Vec2i varying_uv[3];
-    float varying_intensity[3];
-
+    // varying layout : [0] u, [1] v, [2] intensity, [3..5] shadowbuffer coords
+    unsigned char alpha; // for blended draws
+    Shader() : IShader(6), alpha(255) {}
     virtual ~Shader() {}
-    virtual Vec3f vertex(int iface, int nvert)
+    virtual Vec4f vertex(int iface, int nvert)
     {
-        varying_uv[nvert] = model->uv(iface, nvert);
-        varying_intensity[nvert] = model->norm(iface, nvert) * light_dir;
+        Vec2f uv = model->uv(iface, nvert);
+        varying[nvert][0] = uv.u;
+        varying[nvert][1] = uv.v;
+        varying[nvert][2] = model->norm(iface, nvert) * uniforms->light_dir;
 
         Vec3f vertex = model->vert(iface, nvert);
-        Vec3f transformed_vertex = ViewPort * Projection * ModelView * Matrix(vertex);
-        return transformed_vertex;
+        if (uniforms->shadowbuffer)
+        {   // light view is orthographic, so these interpolate exactly
+            Vec3f sb = Vec3f(uniforms->Mshadow * Matrix(vertex));
+            for (int i = 0; i < 3; i++) varying[nvert][3 + i] = sb[i];
+        }
+        return Vec4f(uniforms->MVP * Matrix(vertex));
     }
-    virtual bool fragment(Vec3f bar, TGAColor& color)
+    virtual bool fragment(const float* interp, TGAColor& color)
     {
-        // get uv, intensity at bar
-        Vec2i uv = varying_uv[0] * bar.x + varying_uv[1] * bar.y + varying_uv[2] * bar.z;
-        float intensity = bar.x * varying_intensity[0] + bar.y * varying_intensity[1] + bar.z * varying_intensity[2];
-        intensity = std::max(0.0f, std::min(1.0f, intensity));
+        // uv, intensity come interpolated from the rasterizer
+        Vec2f uv(interp[0], interp[1]);
+        float intensity = std::max(0.0f, std::min(1.0f, interp[2]));
+        if (uniforms->shadowbuffer)
+        {
+            int sx = (int)interp[3], sy = (int)interp[4];
+            float lit = uniforms->shadowbuffer->get(sx, sy)[0] <= interp[5] + shadow_bias ? 1.0f : 0.3f;
+            intensity *= lit;
+        }
 
         color = model->diffuse(uv) * intensity;
+        color.a = alpha;
         return false;
     }
 };
 
-struct GouraudShader : IShader
+// lighting done per pixel from the interpolated normal : no varying depends on the light,
+// so the G-buffer of one raster can be relit (lookdev)
+struct PhongShader : IShader
+{
+    // varying layout : [0] u, [1] v, [2..4] normal
+    PhongShader() : IShader(5) {}
+    virtual ~PhongShader() {}
+    virtual Vec4f vertex(int iface, int nvert)
+    {
+        Vec2f uv = model->uv(iface, nvert);
+        Vec3f n = model->norm(iface, nvert);
+        varying[nvert][0] = uv.u;
+        varying[nvert][1] = uv.v;
+        for (int i = 0; i < 3; i++) varying[nvert][2 + i] = n[i];
+        return Vec4f(uniforms->MVP * Matrix(model->vert(iface, nvert)));
+    }
+    virtual bool fragment(const float* interp, TGAColor& color)
+    {
+        Vec3f n = Vec3f(interp[2], interp[3], interp[4]).normalize();
+        float intensity = std::max(0.0f, std::min(1.0f, n * uniforms->light_dir));
+        color = model->diffuse(Vec2f(interp[0], interp[1])) * intensity;
+        return false;
+    }
+};
+
+// per-instance transform and tint, the mesh itself is shared by every copy
+struct InstancedShader : IShader
 {
-    // varying : share value in vertex shader and fragment shader
-    float varying_intensity[3];
+    // varying layout : [0] u, [1] v, [2] intensity
+    Matrix uniform_M; // object -> screen for the current instance
+    float uniform_tint[3];
 
+    InstancedShader() : IShader(3) {}
+    virtual ~InstancedShader() {}
+    virtual void instance(const Instance& inst)
+    {
+        uniform_M = uniforms->MVP * inst.transform;
+        for (int i = 0; i < 3; i++) uniform_tint[i] = inst.params[i];
+    }
+    virtual Vec4f vertex(int iface, int nvert)
+    {
+        Vec2f uv = model->uv(iface, nvert);
+        varying[nvert][0] = uv.u;
+        varying[nvert][1] = uv.v;
+        varying[nvert][2] = model->norm(iface, nvert) * uniforms->light_dir; // instance transforms are translate + uniform scale
+
+        return Vec4f(uniform_M * Matrix(model->vert(iface, nvert)));
+    }
+    virtual bool fragment(const float* interp, TGAColor& color)
+    {
+        float intensity = std::max(0.0f, std::min(1.0f, interp[2]));
+        color = model->diffuse(Vec2f(interp[0], interp[1])) * intensity;
+        for (int i = 0; i < 3; i++) color[2 - i] = (unsigned char)(color[2 - i] * uniform_tint[i]); // raw is b, g, r
+        return false;
+    }
+};
+
+// position only, feeds the depth-only triangle()
+struct DepthShader : IShader
+{
+    DepthShader() : IShader(0) {}
+    virtual ~DepthShader() {}
+    virtual Vec4f vertex(int iface, int nvert)
+    {
+        Vec3f vertex = model->vert(iface, nvert);
+        return Vec4f(uniforms->MVP * Matrix(vertex));
+    }
+    virtual bool fragment(const float*, TGAColor&) { return true; }
+};
+
+struct GouraudShader : IShader
+{
+    // varying layout : [0] intensity
+    GouraudShader() : IShader(1) {}
     virtual ~GouraudShader() {}
-    virtual Vec3f vertex(int iface, int nvert)
+    virtual Vec4f vertex(int iface, int nvert)
     {
-        varying_intensity[nvert] = model->norm(iface, nvert) * light_dir;
+        varying[nvert][0] = model->norm(iface, nvert) * uniforms->light_dir;
         Vec3f vertex = model->vert(iface, nvert);
-        Vec3f transformed_vertex = ViewPort * Projection * ModelView * Matrix(vertex);
-        return transformed_vertex;
+        return Vec4f(uniforms->MVP * Matrix(vertex));
     }
-    virtual bool fragment(Vec3f bar, TGAColor& color)
+    virtual bool fragment(const float* interp, TGAColor& color)
     {
-        float intensity = bar[0] * varying_intensity[0] + bar[1] * varying_intensity[1] + bar[2] * varying_intensity[2];
-        intensity = std::max(0.0f, std::min(1.0f, intensity));
+        float intensity = std::max(0.0f, std::min(1.0f, interp[0]));
         color = TGAColor(255, 255, 255) * intensity;
         return false;
     }
 };
 
+// n x n copies spread over [-1,1]^2, tinted by grid position
+std::vector<Instance> instance_field(int n)
+{
+    std::vector<Instance> instances(n * n);
+    float scale = 2.0f / n;
+    for (int i = 0; i < (int)instances.size(); i++)
+    {
+        int gx = i % n, gy = i / n;
+        Matrix m = Matrix::identity(4);
+        m[0][0] = m[1][1] = m[2][2] = scale * 0.5f;
+        m[0][3] = (gx + 0.5f) * scale - 1.0f;
+        m[1][3] = (gy + 0.5f) * scale - 1.0f;
+        instances[i].transform = m;
+        instances[i].params[0] = (float)gx / n;
+        instances[i].params[1] = (float)gy / n;
+        instances[i].params[2] = 1.0f;
+    }
+    return instances;
+}
+
 int main(int argc, char** argv) 
 {
+    if (argc > 1 && !strcmp(argv[1], "compare")) return compare_main(argc - 1, argv + 1); // image diff tool, see compare.h
+    const bool tile_worker = argc > 1 && !strcmp(argv[1], "worker"); // started by a distributed render, see distributed.h
+
     TGAImage image(width, height, TGAImage::RGB);
     TGAImage zbuffer(width, height, TGAImage::GRAYSCALE);
 
-    model = new Model("obj\\african_head.obj");
+    Model* model = new Model("obj\\african_head.obj", (size_t)texture_budget_kb * 1024);
+    model->build_lods(lod_levels, lod_cache && !tile_worker ? "obj\\african_head.lod" : nullptr);
+    if (quantized_vertices) model->quantize();
+    Vec3f model_center = (model->bbox_min() + model->bbox_max()) * 0.5f;
 
-    lookat(camera, center, Vec3f(0, 1, 0));
-    viewport(width / 8, height / 8, width * 3 / 4, height * 3 / 4);
-    projection(-1.0f / (camera - center).norm());
+    Uniforms light;
+    light.ModelView = lookat(light_dir, center, Vec3f(0, 1, 0));
+    light.Projection = projection(0);
+    light.ViewPort = viewport(width / 8, height / 8, width * 3 / 4, height * 3 / 4);
+    light.update();
+
+    Uniforms view;
+    view.ModelView = lookat(camera, center, Vec3f(0, 1, 0));
+    view.Projection = projection(-1.0f / (camera - center).norm());
+    view.ViewPort = viewport(width / 8, height / 8, width * 3 / 4, height * 3 / 4);
+    view.light_dir = light_dir;
+    view.shading_rate = shading_rate;
+    view.blend = model_blend;
+    view.update();
+
+    // first frame at full rate, the next ones follow the previous frame
+    TGAImage rate_map((width + SHADING_TILE - 1) / SHADING_TILE, (height + SHADING_TILE - 1) / SHADING_TILE, TGAImage::GRAYSCALE);
+    for (int y = 0; y < rate_map.get_height(); y++)
+    {
+        for (int x = 0; x < rate_map.get_width(); x++) rate_map.set(x, y, TGAColor(1));
+    }
+    if (adaptive_shading > 0) view.shading_rate_map = &rate_map;
+
+    TGAImage shadowmap(width, height, TGAImage::GRAYSCALE);
+    if (shadow_pass)
+    {   // render depth from light_dir
+        DepthShader depthShader;
+        CommandBuffer shadow;
+        shadow.bind_target(nullptr, &shadowmap);
+        shadow.set_uniforms(light);
+        shadow.draw(model, &depthShader);
+        shadow.execute();
+
+        view.Mshadow = light.MVP;
+        view.shadowbuffer = &shadowmap;
+    }
 
     Shader shader;
+    shader.alpha = (unsigned char)model_alpha;
     GouraudShader gShader;
 
-    for (int i = 0; i < model->nfaces(); i++)
+    if (distributed_workers > 0 || tile_worker)
+    {
+        // the viewport moves screen pixel (t.x, t.y) to the tile origin
+        auto render_tile = [&](const TileRequest& t, TGAImage& tile)
+        {
+            float angle = 2 * 3.14159265f * t.frame / distributed_frames;
+            Vec3f eye(camera.x * std::cos(angle) + camera.z * std::sin(angle), camera.y, camera.z * std::cos(angle) - camera.x * std::sin(angle));
+            Uniforms u = view;
+            u.ModelView = lookat(eye, center, Vec3f(0, 1, 0));
+            u.ViewPort = viewport(width / 8 - t.x, height / 8 - t.y, width * 3 / 4, height * 3 / 4);
+            u.shading_rate_map = nullptr;
+            u.update();
+            TGAImage depth(t.w, t.h, TGAImage::GRAYSCALE);
+            model->set_lod(model->select_lod(pixels_per_unit(u, u.ModelView, model_center), lod_pixel_error));
+            shader.bind(model, &u);
+            draw(shader, 0, model->nfaces(), &tile, depth, zprepass);
+            reset_frame();
+            return true;
+        };
+        if (tile_worker) return serve_tiles(argc - 1, argv + 1, TGAImage::RGB, render_tile);
+
+        auto write_frame = [](int f, TGAImage& frame)
+        {
+            char name[64];
+            snprintf(name, sizeof(name), "output\\frame_%03d.tga", f);
+            frame.flip_vertically();
+            frame.write_tga_file(name);
+        };
+        DistributedOptions options;
+        options.workers = distributed_workers;
+        options.tile_size = distributed_tile;
+        options.fail_every = distributed_fail_every;
+        options.program = argv[0];
+        bool ok = render_distributed(options, width, height, TGAImage::RGB, distributed_frames, write_frame);
+        delete model;
+        return ok ? 0 : 1;
+    }
+
+    // everything that allocates is set up before the frame loop
+    std::vector<Instance> instances = instance_field(instance_grid);
+    std::vector<Instance> by_lod(instances.size()); // the instances grouped by the LOD they pick, each group one draw
+    std::vector<int> instance_lod(instances.size()), lod_start(model->nlods() + 1);
+    InstancedShader instancedShader;
+    PhongShader phongShader;
+    GBuffer gbuffer(lookdev ? width : 0, lookdev ? height : 0, phongShader.nvaryings);
+    CommandBuffer frame;
+    frame.bind_target(&image, &zbuffer);
+    frame.clear();
+    frame.set_uniforms(view);
+    frame.draw(model, &shader, 0, -1, zprepass);
+
+    for (int f = 0; f < frames; f++)
     {
-        Vec3i screen_coords[3];
-        // Vertex Shader
-        for (int j = 0; j < 3; j++)
+        NoMallocScope no_malloc(f > 0);
+        if (instance_grid > 0)
+        {
+            image.clear();
+            zbuffer.clear();
+            // every copy picks its own LOD by its distance, then each level is drawn in one batch
+            std::fill(lod_start.begin(), lod_start.end(), 0);
+            for (int i = 0; i < (int)instances.size(); i++)
+            {
+                Matrix object_to_view = view.ModelView * instances[i].transform;
+                instance_lod[i] = model->select_lod(pixels_per_unit(view, object_to_view, model_center), lod_pixel_error);
+                lod_start[instance_lod[i] + 1]++;
+            }
+            for (int l = 0; l < model->nlods(); l++) lod_start[l + 1] += lod_start[l];
+            for (int i = 0; i < (int)instances.size(); i++) by_lod[lod_start[instance_lod[i]]++] = instances[i];
+            for (int l = 0, start = 0; l < model->nlods(); l++)
+            {   // lod_start[l] now ends group l
+                if (lod_start[l] == start) continue;
+                model->set_lod(l);
+                draw_instanced(instancedShader, *model, view, by_lod.data() + start, lod_start[l] - start, image, zbuffer);
+                start = lod_start[l];
+            }
+        }
+        else
         {
-            screen_coords[j] = shader.vertex(i, j);
+            model->set_lod(model->select_lod(pixels_per_unit(view, view.ModelView, model_center), lod_pixel_error));
+
+            if (lookdev)
+            {
+                float angle = f * 0.5f; // around y
+                view.light_dir = Vec3f(light_dir.x * std::cos(angle) + light_dir.z * std::sin(angle), light_dir.y,
+                                       light_dir.z * std::cos(angle) - light_dir.x * std::sin(angle));
+                if (gbuffer.current(model, view.MVP))
+                {   // same geometry and view : one screen-space pass, blended over the background rather than the last frame
+                    image.clear();
+                    relight(phongShader, *model, view, gbuffer, image);
+                }
+                else
+                {
+                    image.clear();
+                    zbuffer.clear();
+                    gbuffer.clear();
+                    phongShader.bind(model, &view);
+                    draw(phongShader, 0, model->nfaces(), &image, zbuffer, zprepass, &gbuffer);
+                }
+            }
+            // Vertex Shader + Rasterizer (callback Fragment Shader each visible pixel)
+            else frame.execute();
+            if (wireframe_overlay)
+            {
+                wireframe(*model, view.MVP, image, TGAColor(255, 255, 255), &zbuffer);
+            }
         }
-        // Rasterizer (callback Fragment Shader each pixel)
-        triangle(screen_coords, shader, image, zbuffer);
+        if (adaptive_shading > 0) shading_rate_from(image, rate_map, adaptive_shading);
+        if (model->virtual_diffuse())
+        {   // feedback of the frame, then back under the budget
+            VirtualTextureStats vt = model->virtual_diffuse()->end_frame();
+            printf("frame %d texture : %d tiles sampled, %d loaded, %d unpaged, %d evicted, %d resident (%d KB)\n", f, vt.requested, vt.loaded, vt.unpaged, vt.evicted, vt.resident, (int)(vt.resident_bytes / 1024));
+        }
+        reset_frame(); // frame 0 sizes the arenas, later frames only rewind them
     }
 
-    image.flip_vertically();
+    image.flip_vertically(); // only flips the strides, the file is written bottom-up
     image.write_tga_file("output\\output14.tga");
+    for (int size : thumbnail_sizes)
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "output\\thumb_%d.tga", size);
+        resample(image, size, size * height / width, FILTER_LANCZOS3).write_tga_file(name);
+    }
     zbuffer.flip_vertically();
     zbuffer.write_tga_file("zbuffer.tga");
 
+    if (poster_size > 0)
+    {   // same view at poster resolution, the shadow map is reused as is
+        Uniforms poster = view;
+        poster.ViewPort = viewport(poster_size / 8, poster_size / 8, poster_size * 3 / 4, poster_size * 3 / 4);
+        poster.update();
+        model->set_lod(model->select_lod(pixels_per_unit(poster, poster.ModelView, model_center), lod_pixel_error));
+        shader.bind(model, &poster);
+        if (!draw_streamed(shader, 0, model->nfaces(), poster_size, poster_size * height / width, poster_band, "output\\poster.tga"))
+        {
+            fprintf(stderr, "can't write the poster\n");
+        }
+    }
+
     delete model;
 
     return 0;
@@ -1,11 +1,76 @@
+#include <algorithm>
+#include <cstdio>
 #include <iostream>
 #include <string>
 #include <fstream>
 #include <sstream>
 #include <vector>
 #include "model.h"
+#include "simplify.h"
 
-Model::Model(const char* filename) : verts_(), faces_(), norms_(), uv_()
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MODEL_SSE2
+#endif
+
+// out[0..3] = q[0..3] * scale + bias, q has 4 readable values (the arrays keep spares at the end)
+static void dequantize(const unsigned short* q, const float* scale, const float* bias, float* out)
+{
+#ifdef MODEL_SSE2
+	__m128i v = _mm_loadl_epi64((const __m128i*)q);
+	v = _mm_unpacklo_epi16(v, _mm_setzero_si128());
+	__m128 f = _mm_cvtepi32_ps(v);
+	__m128 b = _mm_setr_ps(bias[0], bias[1], bias[2], 0.0f);
+	_mm_storeu_ps(out, _mm_add_ps(_mm_mul_ps(f, _mm_loadu_ps(scale)), b));
+#else
+	for (int i = 0; i < 3; i++) out[i] = q[i] * scale[i] + bias[i];
+	out[3] = 0;
+#endif
+}
+
+static unsigned short quantize16(float v, float lo, float scale)
+{
+	float q = scale > 0 ? (v - lo) / scale + 0.5f : 0.0f;
+	return (unsigned short)std::max(0.0f, std::min(65535.0f, q));
+}
+
+static short snorm16(float v)
+{
+	v = std::max(-1.0f, std::min(1.0f, v));
+	return (short)(v * 32767.0f + (v < 0 ? -0.5f : 0.5f));
+}
+
+// octahedral map : the unit sphere folded onto [-1,1]^2, both halves packed as snorm16
+static unsigned int oct_encode(Vec3f n)
+{
+	float l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+	if (l1 <= 0) return 0;
+	float x = n.x / l1, y = n.y / l1;
+	if (n.z < 0)
+	{
+		float fx = (1 - std::abs(y)) * (x >= 0 ? 1 : -1);
+		float fy = (1 - std::abs(x)) * (y >= 0 ? 1 : -1);
+		x = fx;
+		y = fy;
+	}
+	return (unsigned short)snorm16(x) | (unsigned int)(unsigned short)snorm16(y) << 16;
+}
+
+static Vec3f oct_decode(unsigned int q)
+{
+	float x = (short)(q & 0xffff) / 32767.0f, y = (short)(q >> 16) / 32767.0f;
+	float z = 1 - std::abs(x) - std::abs(y);
+	if (z < 0)
+	{
+		float fx = (1 - std::abs(y)) * (x >= 0 ? 1 : -1);
+		float fy = (1 - std::abs(x)) * (y >= 0 ? 1 : -1);
+		x = fx;
+		y = fy;
+	}
+	return Vec3f(x, y, z).normalize();
+}
+
+Model::Model(const char* filename, size_t texture_budget) : verts_(), faces_(), lods_(), lod_error_(1, 0.0f), lod_(0), edges_(), norms_(), uv_(), vdiffuse_(nullptr), quantized_(false), nverts_(0)
 {
 	std::ifstream in;
 	in.open(filename, std::ifstream::in);
@@ -31,7 +96,7 @@ Model::Model(const char* filename) : verts_(), faces_(), norms_(), uv_()
 			iss >> trash >> trash; // delete char v, char n
 			Vec3f n;
 			for (int i = 0; i < 3; i++) iss >> n[i];
-			norms_.push_back(n);
+			norms_.push_back(n.normalize()); // once here, norm() is called from worker threads
 		}
 		// Store texture vertices ( u, v with [0,1] )
 		else if (!line.compare(0, 3, "vt "))
@@ -55,33 +120,84 @@ Model::Model(const char* filename) : verts_(), faces_(), norms_(), uv_()
 			faces_.push_back(f);
 		}
 	}
+	for (int i = 0; i < (int)verts_.size(); i++)
+	{
+		for (int j = 0; j < 3; j++)
+		{
+			bbmin_[j] = i ? std::min(bbmin_[j], verts_[i][j]) : verts_[i][j];
+			bbmax_[j] = i ? std::max(bbmax_[j], verts_[i][j]) : verts_[i][j];
+		}
+	}
 	std::cerr << "# v# " << verts_.size() << " f# " << faces_.size() << std::endl;
-	load_texture(filename, "_diffuse.tga", diffusemap_);
+	build_edges();
+	if (texture_budget > 0) load_virtual_texture(filename, "_diffuse", texture_budget, vdiffuse_);
+	else load_texture(filename, "_diffuse.tga", diffusemap_);
 }
 
-Model::~Model() {}
+Model::~Model()
+{
+	delete vdiffuse_;
+}
+
+int Model::nverts() { return quantized_ ? nverts_ : (int)verts_.size(); }
+
+int Model::nfaces()
+{
+	if (!quantized_) return (int)faces().size();
+	return (int)(index32_.empty() ? index16_[lod_].size() : index32_[lod_].size()) / 9;
+}
 
-int Model::nverts() { return (int)verts_.size(); }
+Vec3f Model::bbox_min() { return bbmin_; }
 
-int Model::nfaces() { return (int)faces_.size(); }
+Vec3f Model::bbox_max() { return bbmax_; }
 
-std::vector<int> Model::face(int idx) 
+Vec3i Model::face(int idx) 
 {	// Format : f v/vt/vn/v/vt/vn/v/vt/vn --> abstract only v
 	// present status of face[i] :: [0] : v,vt,vn , [1] : v,vt,vn, [2] : v,vt,vn
+	if (quantized_) return Vec3i(index(idx, 0, 0), index(idx, 1, 0), index(idx, 2, 0));
+	std::vector<Vec3i>& f = faces()[idx];
+	return Vec3i(f[0][0], f[1][0], f[2][0]); 
+}
 
-	std::vector<int> face;
-	for (int i = 0; i < (int)faces_[idx].size(); i++)
+const std::vector<Vec2i>& Model::edges() { return edges_[lod_]; }
+
+// every LOD's edges up front, so drawing never writes to the model
+void Model::build_edges()
+{
+	edges_.assign(nlods(), std::vector<Vec2i>());
+	for (int l = 0; l < nlods(); l++)
 	{
-		face.push_back(faces_[idx][i][0]);
+		std::vector<long long> keys; // smaller index in the high half, so each edge sorts to one key
+		std::vector<std::vector<Vec3i>>& f = l ? lods_[l - 1] : faces_;
+		for (int i = 0; i < (int)f.size(); i++)
+		{
+			for (int k = 0; k < (int)f[i].size(); k++)
+			{
+				long long a = f[i][k][0], b = f[i][(k + 1) % f[i].size()][0];
+				keys.push_back(std::min(a, b) << 32 | std::max(a, b));
+			}
+		}
+		std::sort(keys.begin(), keys.end());
+		keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+		for (int i = 0; i < (int)keys.size(); i++)
+		{
+			edges_[l].push_back(Vec2i((int)(keys[i] >> 32), (int)(keys[i] & 0xffffffff)));
+		}
 	}
-	return face; 
 }
 
-Vec3f Model::vert(int i) { return verts_[i]; }
+Vec3f Model::vert(int i)
+{
+	if (!quantized_) return verts_[i];
+	float v[4];
+	dequantize(&qverts_[i * 3], qscale_, &bbmin_.x, v);
+	return Vec3f(v[0], v[1], v[2]);
+}
 
 Vec3f Model::vert(int iface, int nvert) 
 {
-	int idx = faces_[iface][nvert][0];
+	if (quantized_) return vert(index(iface, nvert, 0));
+	int idx = faces()[iface][nvert][0];
 	return verts_[idx];
 }
 
@@ -97,22 +213,265 @@ void Model::load_texture(std::string filename, const char* suffix, TGAImage& img
 	}
 }
 
-TGAColor Model::diffuse(Vec2i uv)
+// <model><suffix>.vtc, cut from <model><suffix>.tga the first time and again whenever the tga changes
+void Model::load_virtual_texture(std::string filename, const char* suffix, size_t budget, VirtualTexture*& vt)
 {
-	return diffusemap_.get(uv.x, uv.y); 
+	size_t dot = filename.find_last_of(".");
+	if (dot == std::string::npos) return;
+	std::string base = filename.substr(0, dot) + std::string(suffix);
+	std::string cachefile = base + ".vtc", source = base + ".tga";
+	vt = new VirtualTexture();
+	if (vt->open(cachefile.c_str(), budget, source.c_str())) return;
+
+	TGAImage img;
+	load_texture(filename, (std::string(suffix) + ".tga").c_str(), img);
+	if (!VirtualTexture::build(img, cachefile.c_str(), source.c_str()) || !vt->open(cachefile.c_str(), budget, source.c_str()))
+	{   // no cache : keep the whole map after all
+		delete vt;
+		vt = nullptr;
+		diffusemap_ = img;
+	}
 }
 
-Vec2i Model::uv(int iface, int nvert) // find texture's coords in u,v
+TGAColor Model::diffuse(Vec2f uv) // uv in [0,1], nearest texel
 {
-	int idx = faces_[iface][nvert][1];
-	return Vec2i(uv_[idx].x * diffusemap_.get_width(), uv_[idx].y * diffusemap_.get_height()); //implicit casting float to int
+	if (vdiffuse_) return vdiffuse_->sample(uv);
+	return diffusemap_.get(uv.x * diffusemap_.get_width(), uv.y * diffusemap_.get_height()); //implicit casting float to int
+}
+
+Vec2f Model::uv(int iface, int nvert) // find texture's coords in u,v
+{
+	if (quantized_)
+	{
+		float t[4];
+		dequantize(&quv_[index(iface, nvert, 1) * 2], quv_scale_, quv_min_, t);
+		return Vec2f(t[0], t[1]);
+	}
+	int idx = faces()[iface][nvert][1];
+	return uv_[idx];
 }
 
 Vec3f Model::norm(int iface, int nvert)
 {
-	int idx = faces_[iface][nvert][2];
-	return norms_[idx].normalize();
+	if (quantized_) return oct_decode(qnorms_[index(iface, nvert, 2)]);
+	int idx = faces()[iface][nvert][2];
+	return norms_[idx];
 }
 
+void Model::build_lods(int levels, const char* cachefile)
+{
+	if (quantized_)
+	{
+		std::cerr << "build_lods() needs the float mesh, call it before quantize()" << std::endl;
+		return;
+	}
+	lods_.clear();
+	lod_error_.assign(1, 0.0f);
+	lod_ = 0;
+	if (cachefile && load_lods(cachefile, levels))
+	{
+		build_edges();
+		return;
+	}
+
+	// every level is simplified from the full mesh, so its error is measured against the original
+	for (int i = 1; i < levels; i++)
+	{
+		int target = (int)faces_.size() >> i;
+		if (target < 8) break;
+		float error;
+		std::vector<std::vector<Vec3i>> lod = simplify(verts_, faces_, target, error);
+		if (!lods_.empty() && lod.size() >= lods_.back().size()) break; // nothing left to collapse
+		lods_.push_back(lod);
+		lod_error_.push_back(std::max(error, lod_error_.back()));
+		std::cerr << "lod " << i << " f# " << lod.size() << " error " << lod_error_.back() << std::endl;
+	}
+	if (cachefile) save_lods(cachefile, levels);
+	build_edges();
+}
 
+// cache layout : version, nverts, nfaces, levels asked for, nlods, then per LOD : error, nfaces, nfaces * 3 (v, vt, vn)
+static const int LOD_CACHE_VERSION = 2; // 2 : errors are distances to the simplified surface
 
+bool Model::load_lods(const char* cachefile, int levels)
+{
+	std::ifstream in(cachefile, std::ios::binary);
+	if (!in.is_open()) return false;
+	int header[5];
+	in.read((char*)header, sizeof(header));
+	if (!in.good() || header[0] != LOD_CACHE_VERSION || header[1] != nverts() || header[2] != (int)faces_.size() || header[3] != levels
+		|| header[4] < 0 || header[4] >= levels) return false;
+
+	// a stale or damaged file must not size our buffers nor index past the mesh : levels never grow,
+	// and every corner points into the arrays loaded from the .obj
+	const int sizes[3] = { (int)verts_.size(), (int)uv_.size(), (int)norms_.size() };
+	std::vector<std::vector<std::vector<Vec3i>>> lods(header[4]);
+	std::vector<float> errors(1, 0.0f);
+	int bound = (int)faces_.size();
+	for (int l = 0; l < header[4]; l++)
+	{
+		float error;
+		int n;
+		in.read((char*)&error, sizeof(error));
+		in.read((char*)&n, sizeof(n));
+		if (!in.good() || n < 0 || n > bound) return false;
+		bound = n;
+		lods[l].reserve(n);
+		std::vector<Vec3i> tri(3);
+		for (int i = 0; i < n; i++)
+		{
+			for (int k = 0; k < 3; k++)
+			{
+				in.read((char*)tri[k].raw, sizeof(tri[k].raw));
+				for (int j = 0; j < 3; j++)
+				{
+					if (tri[k].raw[j] < 0 || tri[k].raw[j] >= sizes[j]) return false;
+				}
+			}
+			if (!in.good()) return false;
+			lods[l].push_back(tri);
+		}
+		errors.push_back(error);
+	}
+	if (!in.good()) return false;
+	lods_.swap(lods);
+	lod_error_.swap(errors);
+	std::cerr << "lod cache " << cachefile << " loaded, " << lods_.size() << " levels" << std::endl;
+	return true;
+}
+
+void Model::save_lods(const char* cachefile, int levels)
+{
+	// written aside and renamed, a reader never sees half a cache
+	std::string tmpfile = std::string(cachefile) + ".tmp";
+	std::ofstream out(tmpfile.c_str(), std::ios::binary);
+	if (!out.is_open())
+	{
+		std::cerr << "can't write lod cache " << cachefile << std::endl;
+		return;
+	}
+	int header[5] = { LOD_CACHE_VERSION, nverts(), (int)faces_.size(), levels, (int)lods_.size() };
+	out.write((char*)header, sizeof(header));
+	for (int l = 0; l < (int)lods_.size(); l++)
+	{
+		int n = (int)lods_[l].size();
+		out.write((char*)&lod_error_[l + 1], sizeof(float));
+		out.write((char*)&n, sizeof(n));
+		for (int i = 0; i < n; i++)
+		{
+			for (int k = 0; k < 3; k++) out.write((char*)lods_[l][i][k].raw, sizeof(lods_[l][i][k].raw));
+		}
+	}
+	out.close();
+	std::remove(cachefile); // rename() doesn't replace on Windows
+	if (out.fail() || std::rename(tmpfile.c_str(), cachefile))
+	{
+		std::cerr << "can't write lod cache " << cachefile << std::endl;
+		std::remove(tmpfile.c_str());
+	}
+}
+
+int Model::nlods() { return (int)lod_error_.size(); } // lods_ is released by quantize()
+
+float Model::lod_error(int lod) { return lod_error_[lod]; }
+
+int Model::select_lod(float pixels_per_unit, float max_pixel_error)
+{
+	int lod = 0;
+	while (lod + 1 < nlods() && lod_error_[lod + 1] * pixels_per_unit <= max_pixel_error) lod++;
+	return lod;
+}
+
+void Model::set_lod(int lod) { lod_ = std::max(0, std::min(nlods() - 1, lod)); }
+
+int Model::get_lod() { return lod_; }
+
+bool Model::quantized() { return quantized_; }
+
+int Model::index(int iface, int nvert, int k)
+{
+	int i = iface * 9 + nvert * 3 + k;
+	return index32_.empty() ? index16_[lod_][i] : index32_[lod_][i];
+}
+
+void Model::quantize()
+{
+	if (quantized_ || verts_.empty()) return;
+	size_t before = verts_.size() * sizeof(Vec3f) + norms_.size() * sizeof(Vec3f) + uv_.size() * sizeof(Vec2f);
+	size_t before_faces = 0;
+	for (int l = 0; l < nlods(); l++)
+	{
+		std::vector<std::vector<Vec3i>>& f = l ? lods_[l - 1] : faces_;
+		for (int i = 0; i < (int)f.size(); i++) before_faces += sizeof(f[i]) + f[i].size() * sizeof(Vec3i);
+	}
+
+	// positions : 65535 steps across each side of the AABB
+	nverts_ = (int)verts_.size();
+	for (int j = 0; j < 3; j++) qscale_[j] = (bbmax_[j] - bbmin_[j]) / 65535.0f;
+	qscale_[3] = 0;
+	qverts_.resize(verts_.size() * 3 + 1, 0);
+	float max_error = 0;
+	for (int i = 0; i < (int)verts_.size(); i++)
+	{
+		for (int j = 0; j < 3; j++) qverts_[i * 3 + j] = quantize16(verts_[i][j], bbmin_[j], qscale_[j]);
+	}
+
+	// uvs over their own bounds, they may leave [0,1]
+	for (int j = 0; j < 2; j++)
+	{
+		float lo = 0, hi = 0;
+		for (int i = 0; i < (int)uv_.size(); i++)
+		{
+			lo = i ? std::min(lo, uv_[i][j]) : uv_[i][j];
+			hi = i ? std::max(hi, uv_[i][j]) : uv_[i][j];
+		}
+		quv_min_[j] = lo;
+		quv_scale_[j] = (hi - lo) / 65535.0f;
+	}
+	quv_min_[2] = quv_min_[3] = quv_scale_[2] = quv_scale_[3] = 0;
+	quv_.resize(uv_.size() * 2 + 2, 0);
+	for (int i = 0; i < (int)uv_.size(); i++)
+	{
+		for (int j = 0; j < 2; j++) quv_[i * 2 + j] = quantize16(uv_[i][j], quv_min_[j], quv_scale_[j]);
+	}
+
+	qnorms_.resize(norms_.size());
+	for (int i = 0; i < (int)norms_.size(); i++) qnorms_[i] = oct_encode(norms_[i]);
+
+	// indices : 16 bits if every attribute count fits
+	bool wide = std::max(verts_.size(), std::max(uv_.size(), norms_.size())) > 65536;
+	for (int l = 0; l < nlods(); l++)
+	{
+		std::vector<std::vector<Vec3i>>& f = l ? lods_[l - 1] : faces_;
+		std::vector<int> idx;
+		idx.reserve(f.size() * 9);
+		for (int i = 0; i < (int)f.size(); i++)
+		{
+			for (int k = 0; k < 3; k++)
+			{
+				for (int a = 0; a < 3; a++) idx.push_back(f[i][k][a]);
+			}
+		}
+		if (wide) index32_.push_back(idx);
+		else index16_.push_back(std::vector<unsigned short>(idx.begin(), idx.end()));
+	}
+
+	quantized_ = true;
+	for (int i = 0; i < (int)verts_.size(); i++)
+	{
+		Vec3f d = vert(i) - verts_[i];
+		max_error = std::max(max_error, std::max(std::abs(d.x), std::max(std::abs(d.y), std::abs(d.z))));
+	}
+	size_t after = qverts_.size() * 2 + qnorms_.size() * 4 + quv_.size() * 2;
+	size_t after_faces = 0;
+	for (int l = 0; l < (int)index16_.size(); l++) after_faces += index16_[l].size() * 2;
+	for (int l = 0; l < (int)index32_.size(); l++) after_faces += index32_[l].size() * 4;
+	std::cerr << "quantized : vertex data " << before << " -> " << after << " bytes, faces " << before_faces << " -> " << after_faces
+		<< " bytes, max position error " << max_error << std::endl;
+
+	std::vector<Vec3f>().swap(verts_);
+	std::vector<Vec3f>().swap(norms_);
+	std::vector<Vec2f>().swap(uv_);
+	std::vector<std::vector<Vec3i>>().swap(faces_);
+	std::vector<std::vector<std::vector<Vec3i>>>().swap(lods_);
+}
@@ -3,26 +3,69 @@
 #include <vector>
 #include "geometry.h"
 #include "tgaimage.h"
+#include "vtexture.h"
 
 class Model
 {
 private:
 	std::vector<Vec3f> verts_;
 	std::vector<std::vector<Vec3i>> faces_; // store faces_verts/uv/normal
+	std::vector<std::vector<std::vector<Vec3i>>> lods_; // simplified face lists, lods_[i] is LOD i + 1
+	std::vector<float> lod_error_; // object space error of each LOD, [0] = 0
+	int lod_;
+	std::vector<std::vector<Vec2i>> edges_; // per LOD, unique (v, v) pairs
 	std::vector<Vec3f> norms_;
 	std::vector<Vec2f> uv_;
+	Vec3f bbmin_, bbmax_;
 	TGAImage diffusemap_;
+	VirtualTexture* vdiffuse_; // paged diffuse map, see Model()
+
+	// compact storage after quantize(), the float arrays and face lists above are released
+	bool quantized_;
+	int nverts_;
+	std::vector<unsigned short> qverts_; // x, y, z per vertex over the AABB (+1 spare for the 8 byte SIMD load)
+	std::vector<unsigned int> qnorms_;   // octahedral, x and y as snorm16
+	std::vector<unsigned short> quv_;    // u, v over the uv bounds (+2 spare)
+	float qscale_[4], quv_min_[4], quv_scale_[4];
+	std::vector<std::vector<unsigned short>> index16_; // per LOD (0 = full mesh) : v, vt, vn of 3 corners per face
+	std::vector<std::vector<int>> index32_;            // same, when a count does not fit in 16 bits
+	int index(int iface, int nvert, int k);
 	void load_texture(std::string filename, const char* suffix, TGAImage& img);
+	void load_virtual_texture(std::string filename, const char* suffix, size_t budget, VirtualTexture*& vt);
+	std::vector<std::vector<Vec3i>>& faces() { return lod_ ? lods_[lod_ - 1] : faces_; }
+	bool load_lods(const char* cachefile, int levels);
+	void save_lods(const char* cachefile, int levels);
+	void build_edges();
 
 public:
-	Model(const char* filename);
+	// texture_budget > 0 : the diffuse map is paged in tiles from <model>_diffuse.vtc (cut from the
+	// tga on first use) with at most that many bytes resident, instead of being decoded whole
+	Model(const char* filename, size_t texture_budget = 0);
 	~Model();
 	int nverts();
 	int nfaces();
+	Vec3f bbox_min();
+	Vec3f bbox_max();
 	Vec3f vert(int i);
 	Vec3f vert(int iface, int nvert); 
-	Vec2i uv(int iface, int nvert);
+	Vec2f uv(int iface, int nvert);
 	Vec3f norm(int iface, int nvert);
-	TGAColor diffuse(Vec2i uv);
-	std::vector<int> face(int idx);
+	TGAColor diffuse(Vec2f uv);
+	VirtualTexture* virtual_diffuse() { return vdiffuse_; } // null unless paged, end_frame() it after every frame
+	Vec3i face(int idx);
+	const std::vector<Vec2i>& edges(); // deduplicated edges of the active LOD, built with the LODs (read-only while drawing)
+
+	// LOD chain : level i has about nfaces / 2^i faces, built once at load. cachefile (opt-in) keeps the
+	// chain across runs, it is rebuilt when the mesh or levels differ. only one process should pass it
+	void build_lods(int levels, const char* cachefile = nullptr);
+	int nlods();
+	float lod_error(int lod);
+	int select_lod(float pixels_per_unit, float max_pixel_error); // coarsest LOD within the pixel error
+	void set_lod(int lod); // vert/uv/norm(iface, nvert) and nfaces() follow the active LOD
+	int get_lod();
+
+	// 16 bit positions relative to the AABB, octahedral normals, 16 bit uvs and 16 bit indices when the
+	// counts allow. call after build_lods(), decoding happens in vert/uv/norm. polygons keep their first triangle
+	void quantize();
+	bool quantized();
 };
\ No newline at end of file
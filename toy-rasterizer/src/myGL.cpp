@@ -1,13 +1,16 @@
+#include <algorithm>
+#include <cassert>
 #include <cstdlib>
+#include <cstring>
+#include <functional>
 #include <iostream>
 #include <cmath>
 #include <limits>
+#include <atomic>
+#include <thread>
+#include <vector>
 #include "myGL.h"
 
-Matrix ModelView;
-Matrix Projection;
-Matrix ViewPort;
-
 Matrix lookat(Vec3f eye, Vec3f center, Vec3f up)
 {
     Vec3f z = (eye - center).normalize();
@@ -21,16 +24,14 @@ Matrix lookat(Vec3f eye, Vec3f center, Vec3f up)
         res[2][i] = z[i];
         res[i][3] = -center[i];
     }
-    ModelView = res;
     return res;
 }
 
 Matrix projection(float coeff)
 {
-    Projection = Matrix::identity(4);
-    Projection[3][2] = coeff;
-
-    return Projection;
+    Matrix m = Matrix::identity(4);
+    m[3][2] = coeff;
+    return m;
 }
 
 Matrix viewport(int x, int y, int w, int h)
@@ -44,7 +45,6 @@ Matrix viewport(int x, int y, int w, int h)
     m[1][1] = h / 2.0f;
     m[2][2] = 255.0f / 2.0f;
 
-    ViewPort = m;
     return m;
 }
 
@@ -64,40 +64,120 @@ Vec3f barycentric(Vec3f A, Vec3f B, Vec3f C, Vec3f P)
     return Vec3f(-1, 1, 1); // in this case generate negative coordinates, it will be thrown away by the rasterizator
 }
 
-void line(Vec2i p0, Vec2i p1, TGAImage& image, TGAColor color)
+// Liang-Barsky : clip segment (x, y, z) p0-p1 to the rect, false if nothing is left
+static bool clip_line(Vec3f& p0, Vec3f& p1, Vec2f clipmin, Vec2f clipmax)
+{
+    Vec3f d = p1 - p0;
+    float p[4] = { -d.x, d.x, -d.y, d.y };
+    float q[4] = { p0.x - clipmin.x, clipmax.x - p0.x, p0.y - clipmin.y, clipmax.y - p0.y };
+    float t0 = 0.0f, t1 = 1.0f;
+    for (int i = 0; i < 4; i++)
+    {
+        if (p[i] == 0)
+        {
+            if (q[i] < 0) return false; // parallel and outside
+            continue;
+        }
+        float r = q[i] / p[i];
+        if (p[i] < 0) t0 = std::max(t0, r);
+        else t1 = std::min(t1, r);
+    }
+    if (t0 > t1) return false;
+    Vec3f start = p0;
+    p0 = start + d * t0;
+    p1 = start + d * t1;
+    return true;
+}
+
+// clip to the pixel centers' cells of the whole image, half a pixel past the border rows and columns.
+// done once per segment : every band then walks the very same pixel path
+static bool clip_to_image(Vec3f& p0, Vec3f& p1, int width, int height)
+{
+    return clip_line(p0, p1, Vec2f(-0.5f, -0.5f), Vec2f(width - 0.5f, height - 0.5f));
+}
+
+// integer Bresenham walk of a segment clipped by clip_to_image() straight into the image rows,
+// only rows [rowmin, rowmax] are written (the walk starts there, not at the segment start).
+// zbuffer (optional) hides the pixels behind the stored depth
+static void walk_line(Vec3f p0, Vec3f p1, int rowmin, int rowmax, TGAImage& image, const TGAColor& color, TGAImage* zbuffer)
 {
+    const float zbias = 2.0f; // lines lie on the surface they were filled from
+    const int width = image.get_width(), height = image.get_height();
+    int x0 = std::max(0, std::min(width - 1, (int)std::floor(p0.x + 0.5f)));
+    int y0 = std::max(0, std::min(height - 1, (int)std::floor(p0.y + 0.5f)));
+    int x1 = std::max(0, std::min(width - 1, (int)std::floor(p1.x + 0.5f)));
+    int y1 = std::max(0, std::min(height - 1, (int)std::floor(p1.y + 0.5f)));
+    float z0 = p0.z, z1 = p1.z;
+
     bool steep = false;
-    if (std::abs(p0.x - p1.x) < std::abs(p0.y - p1.y))
+    if (std::abs(x0 - x1) < std::abs(y0 - y1))
     {   // transpose to make dx > dy
-        std::swap(p0.x, p0.y);
-        std::swap(p1.x, p1.y);
+        std::swap(x0, y0);
+        std::swap(x1, y1);
         steep = true;
     }
-    if (p0.x > p1.x)
-    {   // change p1 <-> p2 to start from left
-        std::swap(p0.x, p1.x);
-        std::swap(p0.y, p1.y);
+    if (x0 > x1)
+    {   // start from left
+        std::swap(x0, x1);
+        std::swap(y0, y1);
+        std::swap(z0, z1);
     }
 
-    int dx = p1.x - p0.x;
-    int dy = p1.y - p0.y;
-    float derror2 = std::abs(dy) * 2;
-    float error2 = 0;
-    int y = p0.y;
+    const int bpp = image.get_bytespp();
+    const int dx = x1 - x0;
+    const int derror2 = std::abs(y1 - y0) * 2;
+    const int ystep = y1 > y0 ? 1 : -1;
+    // y steps taken after k x steps : the walk below steps whenever the error passes dx
+    auto steps = [&](long long k) { long long e = k * derror2 - dx; return e > 0 ? (int)((e + 2LL * dx - 1) / (2LL * dx)) : 0; };
+    // first x step with at least n y steps, n >= 1
+    auto first_with = [&](int n) { return derror2 ? (int)((2LL * dx * (n - 1) + dx) / derror2 + 1) : dx + 1; };
+
+    // x step range whose row is in [rowmin, rowmax]
+    int kmin = 0, kmax = dx;
+    if (steep)
+    {
+        kmin = std::max(kmin, rowmin - x0);
+        kmax = std::min(kmax, rowmax - x0);
+    }
+    else
+    {
+        int nlo = ystep > 0 ? rowmin - y0 : y0 - rowmax; // y steps that reach the band
+        int nhi = ystep > 0 ? rowmax - y0 : y0 - rowmin;
+        if (nhi < 0) return;
+        if (nlo > 0) kmin = std::max(kmin, first_with(nlo));
+        kmax = std::min(kmax, first_with(nhi + 1) - 1);
+    }
+    if (kmin > kmax) return;
 
-    for (int x = p0.x; x <= p1.x; x++)
+    int n = steps(kmin);
+    int y = y0 + ystep * n;
+    int error2 = (int)(kmin * (long long)derror2 - 2LL * dx * n);
+    float dz = dx ? (z1 - z0) / dx : 0.0f;
+    float z = z0 + dz * kmin;
+    for (int x = x0 + kmin; x <= x0 + kmax; x++)
     {
-        if (steep) image.set(y, x, color);
-        else image.set(x, y, color);
+        int px = steep ? y : x, py = steep ? x : y;
+        if (!zbuffer || *zbuffer->pixel(px, py) <= std::min(255.0f, z + zbias)) // zbuffer saturates at 255
+        {
+            memcpy(image.pixel(px, py), color.raw, bpp);
+        }
         error2 += derror2;
         if (error2 > dx)
         {
-            y += (p1.y > p0.y ? 1 : -1);
+            y += ystep;
             error2 -= dx * 2;
         }
+        z += dz;
     }
 }
 
+void line(Vec2i p0, Vec2i p1, TGAImage& image, TGAColor color)
+{
+    Vec3f a(p0.x, p0.y, 0), b(p1.x, p1.y, 0);
+    if (!clip_to_image(a, b, image.get_width(), image.get_height())) return;
+    walk_line(a, b, 0, image.get_height() - 1, image, color, nullptr);
+}
+
 void triangleLines(Vec2i p0, Vec2i p1, Vec2i p2, TGAImage& image, TGAColor color)
 {
     line(p0, p1, image, color);
@@ -105,41 +185,789 @@ void triangleLines(Vec2i p0, Vec2i p1, Vec2i p2, TGAImage& image, TGAColor color
     line(p2, p0, image, color);
 }
 
-void triangle(Vec3i* pts, IShader& shader, TGAImage& image, TGAImage& zbuffer)
+// attribute plane a(x, y) = c + dx * x + dy * y, set up once per triangle
+struct Plane
+{
+    float dx, dy, c;
+    float at(float x, float y) const { return c + dx * x + dy * y; }
+};
+
+static Plane plane(const Vec3f* s, float inv_area, float a0, float a1, float a2)
+{
+    float d1 = a1 - a0;
+    float d2 = a2 - a0;
+    Plane p;
+    p.dx = (d1 * (s[2].y - s[0].y) - d2 * (s[1].y - s[0].y)) * inv_area;
+    p.dy = (d2 * (s[1].x - s[0].x) - d1 * (s[2].x - s[0].x)) * inv_area;
+    p.c = a0 - p.dx * s[0].x - p.dy * s[0].y;
+    return p;
+}
+
+// coarse shading : the color one fragment() call gave to a rate x rate block, per rasterize() call
+struct ShadedBlock
+{
+    int y;               // block row origin, -1 : not shaded yet
+    TGAColor color;
+    bool discard;
+};
+
+static int clamp_rate(int rate)
+{
+    return rate >= 4 ? 4 : (rate >= 2 ? 2 : 1);
+}
+
+// COLOR = false compiles to the depth-only loop : no 1/w, no varyings, no fragment call
+// ZEQUAL = true shades only fragments matching the depth laid down by a prepass, no depth writes.
+// winners (zbuffer sized, optional) : face ids of a prepass. without ZEQUAL a depth tie goes to the
+// higher face id, as a single in-order <= pass would keep it; with ZEQUAL only that face is shaded
+template <bool COLOR, bool ZEQUAL>
+static void rasterize(Vec4f* pts, IShader* shader, TGAImage* image, TGAImage& zbuffer, Vec2i clipmin, Vec2i clipmax, GBuffer* gbuffer = nullptr, int face = -1, int* winners = nullptr)
 {
+    assert(zbuffer.get_bytespp() == TGAImage::GRAYSCALE);
+    for (int i = 0; i < 3; i++)
+    {
+        if (pts[i].w <= 0) return; // behind the eye, there is no near plane clipping
+    }
+
+    // perspective divide, keep 1/w to interpolate varyings/w and recover them per pixel
+    Vec3f s[3];
+    float rw[3];
+    for (int i = 0; i < 3; i++)
+    {
+        rw[i] = 1.0f / pts[i].w;
+        s[i] = Vec3f(pts[i].x * rw[i], pts[i].y * rw[i], pts[i].z * rw[i]);
+    }
+    float area = (s[1].x - s[0].x) * (s[2].y - s[0].y) - (s[2].x - s[0].x) * (s[1].y - s[0].y);
+    if (std::abs(area) < 1e-2) return; // degenerate triangle
+    float inv_area = 1.0f / area;
+
     Vec2i bboxmin(std::numeric_limits<int>::max(), std::numeric_limits<int>::max());
     Vec2i bboxmax(-std::numeric_limits<int>::max(), -std::numeric_limits<int>::max());
-    Vec2i clamp(image.get_width() - 1, image.get_height() - 1);
     for (int i = 0; i < 3; i++)
     {
         for (int j = 0; j < 2; j++)
         {
-            bboxmin[j] = std::max(0, std::min(bboxmin[j], pts[i][j]));
-            bboxmax[j] = std::min(clamp[j], std::max(bboxmax[j], pts[i][j]));
+            bboxmin[j] = std::max(clipmin[j], std::min(bboxmin[j], (int)std::floor(s[i][j])));
+            bboxmax[j] = std::min(clipmax[j], std::max(bboxmax[j], (int)std::ceil(s[i][j])));
+        }
+    }
+    if (bboxmin.x > bboxmax.x || bboxmin.y > bboxmax.y) return;
+
+    // plane equations : barycentric coords (coverage), screen z, 1/w and varying/w
+    const int nvar = COLOR ? shader->nvaryings : 0;
+    Plane bc[3], pz, pw, pv[MAX_VARYINGS];
+    for (int i = 0; i < 3; i++)
+    {
+        bc[i] = plane(s, inv_area, i == 0, i == 1, i == 2);
+    }
+    pz = plane(s, inv_area, s[0].z, s[1].z, s[2].z);
+    if (COLOR)
+    {
+        pw = plane(s, inv_area, rw[0], rw[1], rw[2]);
+        for (int k = 0; k < nvar; k++)
+        {
+            pv[k] = plane(s, inv_area, shader->varying[0][k] * rw[0], shader->varying[1][k] * rw[1], shader->varying[2][k] * rw[2]);
+        }
+    }
+
+    float vw[MAX_VARYINGS]; // varying/w stepped along the scanline
+    float interp[MAX_VARYINGS];
+    const int zstride = zbuffer.get_xstride();
+
+    // shading rate : coverage and depth stay per pixel, fragment() runs once per block and is broadcast
+    const Uniforms* u = COLOR ? shader->uniforms : nullptr;
+    TGAImage* rate_map = u ? u->shading_rate_map : nullptr;
+    int draw_rate = u ? clamp_rate(u->shading_rate) : 1;
+    if (rate_map)
+    {   // a triangle over tiles of a single rate needs no lookup per pixel
+        int lo = 4, hi = 1;
+        for (int ty = bboxmin.y / SHADING_TILE; ty <= bboxmax.y / SHADING_TILE && lo >= hi; ty++)
+        {
+            for (int tx = bboxmin.x / SHADING_TILE; tx <= bboxmax.x / SHADING_TILE; tx++)
+            {
+                int r = clamp_rate(*rate_map->pixel(tx, ty));
+                lo = std::min(lo, r);
+                hi = std::max(hi, r);
+            }
+        }
+        if (lo == hi)
+        {
+            draw_rate = lo;
+            rate_map = nullptr;
+        }
+    }
+
+    // row buffers are scratch in this thread's frame arena, given back when the triangle is done
+    Arena::Scope scratch(frame_arena());
+    const int span_width = bboxmax.x - bboxmin.x + 1;
+    ShadedBlock* blocks = nullptr; // indexed by block column origin - block_base
+    const int block_base = bboxmin.x - 3;
+    if (COLOR && (rate_map || draw_rate > 1))
+    {
+        blocks = frame_arena().alloc<ShadedBlock>(span_width + 3);
+        for (int i = 0; i < span_width + 3; i++) blocks[i].y = -1;
+    }
+
+    // fragments of a row are packed here and merged into the image in one merge_row() call
+    const BlendMode blend = u ? u->blend : BLEND_NONE;
+    const bool zwrite = !ZEQUAL && blend == BLEND_NONE;
+    Color32* span = COLOR ? frame_arena().alloc<Color32>(span_width) : nullptr;
+    unsigned char* covered = COLOR ? frame_arena().alloc<unsigned char>(span_width) : nullptr;
+    // varyings are stepped per pixel only when every covered pixel needs them (full rate, G-buffer),
+    // coarse blocks evaluate the planes once, at their first covered pixel
+    const bool stepped = COLOR && (gbuffer || (!rate_map && draw_rate == 1));
+    auto varyings_at = [&](float px, float py)
+    {
+        float persp = 1.0f / pw.at(px, py);
+        for (int k = 0; k < nvar; k++) interp[k] = pv[k].at(px, py) * persp;
+    };
+    for (int y = bboxmin.y; y <= bboxmax.y; y++)
+    {
+        int written_min = bboxmax.x + 1, written_max = bboxmin.x - 1;
+        if (COLOR) memset(covered, 0, span_width);
+        unsigned char* zp = zbuffer.pixel(bboxmin.x, y);
+        int* wp = winners ? winners + y * zbuffer.get_width() + bboxmin.x : nullptr;
+        float x0 = (float)bboxmin.x;
+        float b0 = bc[0].at(x0, y), b1 = bc[1].at(x0, y), b2 = bc[2].at(x0, y);
+        float z = pz.at(x0, y);
+        float w = 0;
+        if (stepped)
+        {
+            w = pw.at(x0, y);
+            for (int k = 0; k < nvar; k++) vw[k] = pv[k].at(x0, y);
+        }
+
+        int rate = draw_rate;
+        for (int x = bboxmin.x; x <= bboxmax.x; x++)
+        {
+            if (COLOR && rate_map && (x == bboxmin.x || x % SHADING_TILE == 0))
+            {   // tiles are multiples of 4, so blocks never straddle two of them
+                rate = clamp_rate(*rate_map->pixel(x / SHADING_TILE, y / SHADING_TILE));
+            }
+            if (b0 >= 0 && b1 >= 0 && b2 >= 0)
+            {
+                int depth = std::max(0, std::min(255, (int)z));
+                bool pass;
+                if (ZEQUAL) pass = *zp == depth && (!wp || *wp == face);
+                else pass = wp ? *zp < depth || (*zp == depth && *wp < face) : *zp <= depth;
+                if (pass)
+                {
+                    if (zwrite) *zp = (unsigned char)depth;
+                    if (!ZEQUAL && wp) *wp = face;
+                    if (COLOR)
+                    {
+                        if (stepped)
+                        {
+                            float persp = 1.0f / w;
+                            for (int k = 0; k < nvar; k++) interp[k] = vw[k] * persp;
+                            if (gbuffer) gbuffer->store(x, y, face, interp, nvar);
+                        }
+
+                        TGAColor color;
+                        bool discard;
+                        if (rate == 1)
+                        {
+                            if (!stepped) varyings_at((float)x, (float)y); // full rate tile of a rate map
+                            discard = shader->fragment(interp, color);
+                        }
+                        else
+                        {   // rates are powers of 2. the first covered pixel of a block shades it for the
+                            // rest of the triangle, with the varyings there : the block origin may lie
+                            // outside the triangle, where they extrapolate
+                            const int bx = x & ~(rate - 1), by = y & ~(rate - 1);
+                            ShadedBlock* block = &blocks[bx - block_base];
+                            if (block->y != by)
+                            {
+                                varyings_at((float)x, (float)y);
+                                block->y = by;
+                                block->discard = shader->fragment(interp, block->color);
+                            }
+                            color = block->color;
+                            discard = block->discard;
+                        }
+                        if (!discard)
+                        {
+                            span[x - bboxmin.x] = color.val;
+                            covered[x - bboxmin.x] = 0xff;
+                            written_min = std::min(written_min, x);
+                            written_max = x;
+                        }
+                    }
+                }
+            }
+            b0 += bc[0].dx; b1 += bc[1].dx; b2 += bc[2].dx;
+            z += pz.dx;
+            zp += zstride;
+            if (wp) wp++;
+            if (stepped)
+            {
+                w += pw.dx;
+                for (int k = 0; k < nvar; k++) vw[k] += pv[k].dx;
+            }
+        }
+        if (COLOR && written_min <= written_max)
+        {
+            int first = written_min - bboxmin.x;
+            merge_row(image->pixel(written_min, y), image->get_xstride(), image->get_bytespp(), &span[first], &covered[first], written_max - written_min + 1, blend);
+        }
+    }
+}
+
+void triangle(Vec4f* pts, IShader& shader, TGAImage& image, TGAImage& zbuffer)
+{
+    rasterize<true, false>(pts, &shader, &image, zbuffer, Vec2i(0, 0), Vec2i(zbuffer.get_width() - 1, zbuffer.get_height() - 1));
+}
+
+void triangle_zequal(Vec4f* pts, IShader& shader, TGAImage& image, TGAImage& zbuffer)
+{
+    rasterize<true, true>(pts, &shader, &image, zbuffer, Vec2i(0, 0), Vec2i(zbuffer.get_width() - 1, zbuffer.get_height() - 1));
+}
+
+void triangle(Vec4f* pts, TGAImage& zbuffer)
+{
+    rasterize<false, false>(pts, nullptr, nullptr, zbuffer, Vec2i(0, 0), Vec2i(zbuffer.get_width() - 1, zbuffer.get_height() - 1));
+}
+
+void draw(IShader& shader, int begin, int end, TGAImage* image, TGAImage& zbuffer, bool zprepass, GBuffer* gbuffer)
+{
+    assert(!gbuffer || (gbuffer->nvaryings() >= shader.nvaryings && gbuffer->width() == zbuffer.get_width() && gbuffer->height() == zbuffer.get_height()));
+    if (image && gbuffer) gbuffer->stamp(shader.model, shader.uniforms->MVP);
+    const Vec2i clipmax(zbuffer.get_width() - 1, zbuffer.get_height() - 1);
+    if (!image || !zprepass)
+    {
+        for (int i = begin; i < end; i++)
+        {
+            Vec4f screen_coords[3];
+            for (int j = 0; j < 3; j++) screen_coords[j] = shader.vertex(i, j);
+            if (image) rasterize<true, false>(screen_coords, &shader, image, zbuffer, Vec2i(0, 0), clipmax, gbuffer, i);
+            else triangle(screen_coords, zbuffer);
+        }
+        return;
+    }
+
+    // transform once (positions and varyings go to the frame arena), then order clusters of
+    // consecutive faces front to back by their nearest vertex
+    const int cluster_size = 64;
+    const int nfaces = end - begin;
+    const int nvar = shader.nvaryings;
+    int nclusters = (nfaces + cluster_size - 1) / cluster_size;
+    Vec4f* screen_coords = frame_arena().alloc<Vec4f>(nfaces * 3);
+    float* varyings = frame_arena().alloc<float>(nfaces * 3 * nvar);
+    std::pair<float, int>* order = frame_arena().alloc<std::pair<float, int>>(nclusters);
+    for (int c = 0; c < nclusters; c++) order[c] = std::make_pair(-std::numeric_limits<float>::max(), c);
+    for (int i = 0; i < nfaces; i++)
+    {
+        std::pair<float, int>& key = order[i / cluster_size];
+        key.second = i / cluster_size;
+        for (int j = 0; j < 3; j++)
+        {
+            Vec4f& v = screen_coords[i * 3 + j] = shader.vertex(begin + i, j);
+            memcpy(&varyings[(i * 3 + j) * nvar], shader.varying[j], nvar * sizeof(float));
+            key.first = std::max(key.first, v.z / v.w); // larger z is nearer
+        }
+    }
+    std::sort(order, order + nclusters, std::greater<std::pair<float, int>>());
+
+    // depth-only prepass, it also records which face won every pixel : the 8 bit depth ties often,
+    // and a tie must go to the face a single pass in face order would have kept
+    const int npixels = zbuffer.get_width() * zbuffer.get_height();
+    int* winners = frame_arena().alloc<int>(npixels);
+    for (int p = 0; p < npixels; p++) winners[p] = -1;
+    for (int c = 0; c < nclusters; c++)
+    {
+        int first = order[c].second * cluster_size, last = std::min(nfaces, first + cluster_size);
+        for (int i = first; i < last; i++) rasterize<false, false>(&screen_coords[i * 3], nullptr, nullptr, zbuffer, Vec2i(0, 0), clipmax, nullptr, begin + i, winners);
+    }
+    // color pass : one fragment() per pixel, the winner's
+    for (int c = 0; c < nclusters; c++)
+    {
+        int first = order[c].second * cluster_size, last = std::min(nfaces, first + cluster_size);
+        for (int i = first; i < last; i++)
+        {
+            for (int j = 0; j < 3; j++) memcpy(shader.varying[j], &varyings[(i * 3 + j) * nvar], nvar * sizeof(float));
+            rasterize<true, true>(&screen_coords[i * 3], &shader, image, zbuffer, Vec2i(0, 0), clipmax, gbuffer, begin + i, winners);
+        }
+    }
+}
+
+
+bool draw_streamed(IShader& shader, int begin, int end, int width, int height, int band_height, const char* filename)
+{
+    band_height = std::max(1, std::min(band_height, height));
+    const int nbands = (height + band_height - 1) / band_height;
+    const int nfaces = std::max(0, end - begin);
+
+    // transform once and bin faces by the bands their screen y range touches (counting sort)
+    std::vector<Vec4f> screen_coords(nfaces * 3);
+    std::vector<int> band_start(nbands + 1, 0);
+    std::vector<Vec2i> span(nfaces, Vec2i(0, -1)); // first, last band, empty when culled
+    for (int i = 0; i < nfaces; i++)
+    {
+        float ymin = std::numeric_limits<float>::max(), ymax = -ymin;
+        bool visible = true;
+        for (int j = 0; j < 3; j++)
+        {
+            Vec4f& v = screen_coords[i * 3 + j] = shader.vertex(begin + i, j);
+            visible = visible && v.w > 0;
+            if (visible)
+            {
+                ymin = std::min(ymin, v.y / v.w);
+                ymax = std::max(ymax, v.y / v.w);
+            }
+        }
+        if (!visible || ymax < 0 || ymin > height - 1) continue;
+        // clamped as floats : a w close to 0 puts ymax out of int range
+        span[i] = Vec2i((int)std::max(0.0f, ymin) / band_height, (int)std::min((float)(height - 1), std::ceil(ymax)) / band_height);
+        for (int b = span[i].x; b <= span[i].y; b++) band_start[b + 1]++;
+    }
+    for (int b = 0; b < nbands; b++) band_start[b + 1] += band_start[b];
+    std::vector<int> binned(band_start[nbands]);
+    std::vector<int> fill(band_start.begin(), band_start.end() - 1);
+    for (int i = 0; i < nfaces; i++)
+    {
+        for (int b = span[i].x; b <= span[i].y; b++) binned[fill[b]++] = i;
+    }
+
+    TGAStreamWriter out;
+    if (!out.open(filename, width, height, TGAImage::RGB)) return false;
+    const Uniforms* uniforms = shader.uniforms;
+    Uniforms band_uniforms = *uniforms;
+    band_uniforms.shading_rate_map = nullptr; // indexed by screen tiles
+    shader.bind(shader.model, &band_uniforms);
+    // two color bands : one is rendered while the writer encodes the other
+    TGAImage bands[2] = { TGAImage(width, band_height, TGAImage::RGB), TGAImage(width, band_height, TGAImage::RGB) };
+    TGAImage zbuffer(width, band_height, TGAImage::GRAYSCALE);
+    bool ok = true;
+    for (int b = 0; b < nbands && ok; b++)
+    {
+        const int y0 = b * band_height, rows = std::min(band_height, height - y0);
+        TGAImage band = bands[b & 1].view(0, 0, width, rows);
+        TGAImage depth = zbuffer.view(0, 0, width, rows);
+        band.clear();
+        depth.clear();
+        for (int k = band_start[b]; k < band_start[b + 1]; k++)
+        {
+            int i = binned[k];
+            Vec4f pts[3];
+            for (int j = 0; j < 3; j++)
+            {
+                shader.vertex(begin + i, j); // varyings, the shader keeps only one face
+                pts[j] = screen_coords[i * 3 + j];
+                pts[j].y -= y0 * pts[j].w; // into band rows, a screen space shift keeps the interpolation exact
+            }
+            rasterize<true, false>(pts, &shader, &band, depth, Vec2i(0, 0), Vec2i(width - 1, rows - 1));
+        }
+        ok = out.append(band);
+    }
+    shader.bind(shader.model, uniforms);
+    return out.close() && ok;
+}
+
+
+void relight(IShader** shaders, int nthreads, Model& model, const Uniforms& u, const GBuffer& gbuffer, TGAImage& image)
+{
+    assert(gbuffer.width() == image.get_width() && gbuffer.height() == image.get_height());
+    const int rows_per_job = 16;
+    std::atomic<int> next_row(0);
+    auto worker = [&](int t)
+    {
+        if (t >= nthreads) return;
+        IShader& shader = *shaders[t];
+        shader.bind(&model, &u);
+        // a row of fragments goes through the output merger like rasterize() does, blending included
+        const int width = gbuffer.width();
+        Arena::Scope scratch(frame_arena());
+        Color32* span = frame_arena().alloc<Color32>(width);
+        unsigned char* covered = frame_arena().alloc<unsigned char>(width);
+        for (int first; (first = next_row.fetch_add(rows_per_job)) < gbuffer.height();)
+        {
+            int last = std::min(gbuffer.height(), first + rows_per_job);
+            for (int y = first; y < last; y++)
+            {
+                memset(covered, 0, width);
+                for (int x = 0; x < width; x++)
+                {
+                    if (gbuffer.face(x, y) < 0) continue;
+                    TGAColor color;
+                    if (shader.fragment(gbuffer.varyings(x, y), color)) continue;
+                    span[x] = color.val;
+                    covered[x] = 0xff;
+                }
+                merge_row(image.pixel(0, y), image.get_xstride(), image.get_bytespp(), span, covered, width, u.blend);
+            }
+        }
+    };
+    run_workers(worker);
+}
+
+void shading_rate_from(TGAImage& frame, TGAImage& rate_map, int threshold)
+{
+    const int width = frame.get_width(), height = frame.get_height(), bpp = frame.get_bytespp();
+    const int tiles_x = (width + SHADING_TILE - 1) / SHADING_TILE, tiles_y = (height + SHADING_TILE - 1) / SHADING_TILE;
+    assert(rate_map.get_width() >= tiles_x && rate_map.get_height() >= tiles_y && rate_map.get_bytespp() == TGAImage::GRAYSCALE);
+    const int xstride = frame.get_xstride();
+    std::atomic<int> next_row(0);
+    auto worker = [&](int)
+    {
+        int row[2][SHADING_TILE]; // luma of the current and previous row of the tile, b + 2g + r
+        for (int ty; (ty = next_row++) < tiles_y;)
+        {
+            for (int tx = 0; tx < tiles_x; tx++)
+            {   // largest step between neighbours inside the tile, stop early once it is full rate anyway
+                int step = 0;
+                const int x0 = tx * SHADING_TILE, n = std::min(width, x0 + SHADING_TILE) - x0;
+                const int y0 = ty * SHADING_TILE, y1 = std::min(height, y0 + SHADING_TILE);
+                for (int y = y0; y < y1 && step <= threshold * 16; y++)
+                {
+                    int* cur = row[y & 1];
+                    const int* prev = row[(y + 1) & 1];
+                    const unsigned char* p = frame.pixel(x0, y);
+                    for (int i = 0; i < n; i++, p += xstride)
+                    {
+                        cur[i] = bpp == TGAImage::GRAYSCALE ? 4 * p[0] : p[0] + 2 * p[1] + p[2];
+                        if (i > 0) step = std::max(step, std::abs(cur[i] - cur[i - 1]));
+                        if (y > y0) step = std::max(step, std::abs(cur[i] - prev[i]));
+                    }
+                }
+                step /= 4;
+                *rate_map.pixel(tx, ty) = (unsigned char)(step <= threshold ? 4 : (step <= threshold * 4 ? 2 : 1));
+            }
+        }
+    };
+    run_workers(worker);
+}
+
+GBuffer::GBuffer(int width, int height, int nvaryings) : width_(width), height_(height), nvaryings_(nvaryings),
+    faces_(width * height, -1), varyings_(width * height * nvaryings), model_(nullptr), lod_(0), mvp_(Matrix::identity(4))
+{
+}
+
+void GBuffer::clear()
+{
+    std::fill(faces_.begin(), faces_.end(), -1);
+    model_ = nullptr;
+}
+
+void GBuffer::store(int x, int y, int face, const float* interp, int n)
+{
+    int i = x + y * width_;
+    faces_[i] = face;
+    memcpy(&varyings_[i * nvaryings_], interp, sizeof(float) * n);
+}
+
+void GBuffer::stamp(Model* model, const Matrix& mvp)
+{
+    model_ = model;
+    lod_ = model->get_lod();
+    mvp_ = mvp;
+}
+
+bool GBuffer::current(Model* model, const Matrix& mvp) const
+{
+    if (!model_ || model != model_ || model->get_lod() != lod_) return false;
+    for (int i = 0; i < 4; i++)
+    {
+        for (int j = 0; j < 4; j++)
+        {
+            if (mvp[i][j] != mvp_[i][j]) return false;
+        }
+    }
+    return true;
+}
+
+// object space point through a 4x4 matrix, without the temporary Matrix(Vec3f)
+static Vec4f transform(const Matrix& m, const Vec3f& v)
+{
+    Vec4f r;
+    for (int i = 0; i < 4; i++)
+    {
+        r[i] = m[i][0] * v.x + m[i][1] * v.y + m[i][2] * v.z + m[i][3];
+    }
+    return r;
+}
+
+float pixels_per_unit(const Uniforms& u, const Matrix& object_to_view, Vec3f p)
+{
+    // one object unit along view x next to p, both through Projection and ViewPort
+    float scale = Vec3f(object_to_view[0][0], object_to_view[1][0], object_to_view[2][0]).norm();
+    Vec4f c = transform(object_to_view, p);
+    Matrix screen = u.ViewPort * u.Projection;
+    Vec4f a = transform(screen, Vec3f(c.x, c.y, c.z));
+    Vec4f b = transform(screen, Vec3f(c.x + scale, c.y, c.z));
+    if (a.w <= 0 || b.w <= 0) return std::numeric_limits<float>::max();
+    return std::abs(b.x / b.w - a.x / a.w);
+}
+
+void draw_instanced(IShader** shaders, int nthreads, Model& model, const Uniforms& u, const Instance* instances, int ninstances, TGAImage& image, TGAImage& zbuffer)
+{
+    const int width = zbuffer.get_width(), height = zbuffer.get_height();
+
+    // per instance frustum culling : screen bbox of the transformed model AABB
+    int* drawn = frame_arena().alloc<int>(ninstances);
+    int ndrawn = 0;
+    Vec3f bbmin = model.bbox_min(), bbmax = model.bbox_max();
+    for (int n = 0; n < ninstances; n++)
+    {
+        Matrix M = u.MVP * instances[n].transform;
+        Vec2i lo(std::numeric_limits<int>::max(), std::numeric_limits<int>::max());
+        Vec2i hi(-std::numeric_limits<int>::max(), -std::numeric_limits<int>::max());
+        bool behind = false;
+        for (int c = 0; c < 8 && !behind; c++)
+        {
+            Vec3f corner(c & 1 ? bbmax.x : bbmin.x, c & 2 ? bbmax.y : bbmin.y, c & 4 ? bbmax.z : bbmin.z);
+            Vec4f p = transform(M, corner);
+            behind = p.w <= 0; // straddles the eye, let the per-triangle test sort it out
+            for (int j = 0; j < 2 && !behind; j++)
+            {
+                lo[j] = std::min(lo[j], (int)std::floor(p[j] / p.w));
+                hi[j] = std::max(hi[j], (int)std::ceil(p[j] / p.w));
+            }
         }
+        if (behind || (hi.x >= 0 && lo.x < width && hi.y >= 0 && lo.y < height)) drawn[ndrawn++] = n;
     }
-    Vec3i P;
-    for (P.x = bboxmin.x; P.x <= bboxmax.x; P.x++)
+
+    // each worker owns whole bands of rows, so no two threads touch the same pixel
+    const int nbands = nthreads * 2;
+    const int band_height = (height + nbands - 1) / nbands;
+    const int nfaces = model.nfaces();
+    const int nvar = shaders[0]->nvaryings;
+    if (!ndrawn || !nfaces) return;
+
+    // vertex() runs once per drawn instance : positions, varyings and the bands each face touches go
+    // to the frame arena. instances are taken in batches (at least one per worker) small enough for
+    // a batch to still be in cache when its bands are rasterized
+    const size_t instance_bytes = (size_t)nfaces * (3 * sizeof(Vec4f) + 3 * nvar * sizeof(float) + sizeof(Vec2i) + sizeof(int));
+    const int batch = std::max(1, std::min(ndrawn, std::max(nthreads, (int)((1 << 20) / instance_bytes))));
+    const int nslots = batch * nfaces; // face i of the d-th instance of a batch is slot d * nfaces + i
+    Vec4f* coords = frame_arena().alloc<Vec4f>(nslots * 3);
+    float* varyings = frame_arena().alloc<float>(nslots * 3 * nvar);
+    Vec2i* span = frame_arena().alloc<Vec2i>(nslots); // first, last band, empty when culled
+    int* band_start = frame_arena().alloc<int>(nbands + 1);
+    int* fill = frame_arena().alloc<int>(nbands);
+    int* binned = nullptr;
+    int binned_size = 0;
+
+    int first = 0, count = 0; // the batch : drawn[first, first + count)
+    std::atomic<int> next_instance(0);
+    auto transform_worker = [&](int t)
     {
-        for (P.y = bboxmin.y; P.y <= bboxmax.y; P.y++)
+        if (t >= nthreads) return;
+        IShader& shader = *shaders[t];
+        shader.bind(&model, &u);
+        for (int d; (d = next_instance++) < count;)
         {
-            Vec3f bc = barycentric(pts[0], pts[1], pts[2], P);
-            if (bc.x < 0 || bc.y < 0 || bc.z < 0) continue;
-            P.z = 0;
-            for (int i = 0; i < 3; i++)
+            shader.instance(instances[drawn[first + d]]);
+            for (int i = 0; i < nfaces; i++)
             {
-                P.z += pts[i].z * bc[i]; // find z-index in P with u,v 
+                const int slot = d * nfaces + i;
+                float ymin = std::numeric_limits<float>::max(), ymax = -ymin;
+                bool visible = true;
+                for (int j = 0; j < 3; j++)
+                {
+                    Vec4f& v = coords[slot * 3 + j] = shader.vertex(i, j);
+                    memcpy(&varyings[(slot * 3 + j) * nvar], shader.varying[j], nvar * sizeof(float));
+                    visible = visible && v.w > 0;
+                    if (visible)
+                    {
+                        ymin = std::min(ymin, v.y / v.w);
+                        ymax = std::max(ymax, v.y / v.w);
+                    }
+                }
+                span[slot] = Vec2i(0, -1);
+                if (visible && ymax >= 0 && ymin <= height - 1)
+                {
+                    // clamped as floats : a w close to 0 puts ymax out of int range
+                    span[slot] = Vec2i((int)std::max(0.0f, ymin) / band_height, (int)std::min((float)(height - 1), std::ceil(ymax)) / band_height);
+                }
             }
-            
-            if (zbuffer.get(P.x, P.y)[0] > P.z) continue;
-            zbuffer.set(P.x, P.y, TGAColor(P.z));
-            
-            TGAColor color;
-            bool discard = shader.fragment(bc, color);
-            if (!discard)
+        }
+    };
+
+    std::atomic<int> next_band(0);
+    auto raster_worker = [&](int t)
+    {
+        if (t >= nthreads) return;
+        IShader& shader = *shaders[t];
+        for (int band; (band = next_band++) < nbands;)
+        {
+            Vec2i clipmin(0, band * band_height);
+            Vec2i clipmax(width - 1, std::min(height, (band + 1) * band_height) - 1);
+            int current = -1;
+            for (int k = band_start[band]; k < band_start[band + 1]; k++)
+            {
+                const int slot = binned[k], d = slot / nfaces;
+                if (d != current)
+                {   // fragment() may depend on the instance too
+                    shader.instance(instances[drawn[first + d]]);
+                    current = d;
+                }
+                for (int j = 0; j < 3; j++) memcpy(shader.varying[j], &varyings[(slot * 3 + j) * nvar], nvar * sizeof(float));
+                rasterize<true, false>(&coords[slot * 3], &shader, &image, zbuffer, clipmin, clipmax);
+            }
+        }
+    };
+
+    for (first = 0; first < ndrawn; first += count)
+    {
+        count = std::min(batch, ndrawn - first);
+        next_instance = 0;
+        run_workers(transform_worker);
+
+        // bin slots by band (counting sort), the slots of an instance stay together and in order
+        for (int b = 0; b <= nbands; b++) band_start[b] = 0;
+        for (int k = 0; k < count * nfaces; k++)
+        {
+            for (int b = span[k].x; b <= span[k].y; b++) band_start[b + 1]++;
+        }
+        for (int b = 0; b < nbands; b++)
+        {
+            band_start[b + 1] += band_start[b];
+            fill[b] = band_start[b];
+        }
+        if (band_start[nbands] > binned_size)
+        {   // grows a few times in the first batches at most
+            binned_size = band_start[nbands] + band_start[nbands] / 2;
+            binned = frame_arena().alloc<int>(binned_size);
+        }
+        for (int k = 0; k < count * nfaces; k++)
+        {
+            for (int b = span[k].x; b <= span[k].y; b++) binned[fill[b]++] = k;
+        }
+
+        next_band = 0;
+        run_workers(raster_worker);
+    }
+}
+
+void wireframe(Model& model, const Matrix& object_to_screen, TGAImage& image, TGAColor color, TGAImage* zbuffer)
+{
+    // every vertex once, edges share them
+    Vec3f* screen = frame_arena().alloc<Vec3f>(model.nverts());
+    bool* visible = frame_arena().alloc<bool>(model.nverts());
+    for (int i = 0; i < model.nverts(); i++)
+    {
+        Vec4f p = transform(object_to_screen, model.vert(i));
+        visible[i] = p.w > 0;
+        if (visible[i]) screen[i] = Vec3f(p.x / p.w, p.y / p.w, p.z / p.w);
+    }
+
+    const std::vector<Vec2i>& edges = model.edges();
+    const int width = image.get_width(), height = image.get_height();
+    assert(!zbuffer || (zbuffer->get_width() == width && zbuffer->get_height() == height && zbuffer->get_bytespp() == TGAImage::GRAYSCALE));
+
+    // every edge is clipped to the image once, then the bands of rows walk the same pixel paths,
+    // each worker writing only the rows of the band it owns
+    Vec3f* segments = frame_arena().alloc<Vec3f>((int)edges.size() * 2);
+    int nsegments = 0;
+    for (int i = 0; i < (int)edges.size(); i++)
+    {
+        int a = edges[i].x, b = edges[i].y;
+        if (!visible[a] || !visible[b]) continue;
+        Vec3f p0 = screen[a], p1 = screen[b];
+        if (!clip_to_image(p0, p1, width, height)) continue;
+        segments[nsegments * 2] = p0;
+        segments[nsegments * 2 + 1] = p1;
+        nsegments++;
+    }
+
+    const int nthreads = worker_count();
+    const int nbands = nthreads * 2;
+    const int band_height = (height + nbands - 1) / nbands;
+    std::atomic<int> next_band(0);
+    auto worker = [&](int)
+    {
+        for (int band; (band = next_band++) < nbands;)
+        {
+            int rowmin = band * band_height, rowmax = std::min(height, (band + 1) * band_height) - 1;
+            for (int i = 0; i < nsegments && rowmin <= rowmax; i++)
             {
-                image.set(P.x, P.y, color);
+                const Vec3f& p0 = segments[i * 2];
+                const Vec3f& p1 = segments[i * 2 + 1];
+                if (std::max(p0.y, p1.y) < rowmin - 0.5f || std::min(p0.y, p1.y) > rowmax + 0.5f) continue;
+                walk_line(p0, p1, rowmin, rowmax, image, color, zbuffer);
             }
         }
+    };
+
+    run_workers(worker);
+}
+
+void CommandBuffer::bind_target(TGAImage* color, TGAImage* depth, GBuffer* gbuffer)
+{
+    Command c = Command();
+    c.type = BIND_TARGET;
+    c.color = color;
+    c.depth = depth;
+    c.gbuffer = gbuffer;
+    commands_.push_back(c);
+}
+
+void CommandBuffer::clear(bool color, bool depth)
+{
+    Command c = Command();
+    c.type = CLEAR;
+    c.clear_color = color;
+    c.clear_depth = depth;
+    commands_.push_back(c);
+}
+
+void CommandBuffer::set_uniforms(const Uniforms& u)
+{
+    uniforms_.push_back(u);
+    uniforms_.back().update();
+    Command c = Command();
+    c.type = SET_UNIFORMS;
+    c.index = (int)uniforms_.size() - 1;
+    commands_.push_back(c);
+}
+
+void CommandBuffer::draw(Model* model, IShader* shader, int begin, int end, bool zprepass)
+{
+    Command c = Command();
+    c.type = DRAW;
+    c.model = model;
+    c.shader = shader;
+    c.begin = begin;
+    c.end = end;
+    c.zprepass = zprepass;
+    commands_.push_back(c);
+}
+
+void CommandBuffer::reset()
+{
+    commands_.clear();
+    uniforms_.clear();
+}
+
+void CommandBuffer::execute() const
+{
+    TGAImage* color = nullptr;
+    TGAImage* depth = nullptr;
+    GBuffer* gbuffer = nullptr;
+    const Uniforms* uniforms = nullptr;
+    for (int i = 0; i < (int)commands_.size(); i++)
+    {
+        const Command& c = commands_[i];
+        switch (c.type)
+        {
+        case BIND_TARGET:
+            color = c.color;
+            depth = c.depth;
+            gbuffer = c.gbuffer;
+            break;
+        case CLEAR:
+            if (c.clear_color && color) color->clear();
+            if (c.clear_depth && depth) depth->clear();
+            if (c.clear_depth && gbuffer) gbuffer->clear();
+            break;
+        case SET_UNIFORMS:
+            uniforms = &uniforms_[c.index];
+            break;
+        case DRAW:
+            assert(depth && uniforms);
+            c.shader->bind(c.model, uniforms);
+            ::draw(*c.shader, c.begin, c.end < 0 ? c.model->nfaces() : c.end, color, *depth, c.zprepass, gbuffer);
+            break;
+        }
     }
-}
\ No newline at end of file
+}
@@ -1,11 +1,13 @@
 #pragma once
 
+#include <new>
+#include <vector>
+#include "arena.h"
+#include "color.h"
 #include "geometry.h"
+#include "model.h"
 #include "tgaimage.h"
-
-extern Matrix ModelView;
-extern Matrix Projection;
-extern Matrix ViewPort;
+#include "workers.h"
 
 Matrix lookat(Vec3f eye, Vec3f center, Vec3f up);
 
@@ -13,11 +15,78 @@ Matrix projection(float coeff);
 
 Matrix viewport(int x, int y, int w, int h);
 
+// per-draw render state, shaders read it through IShader::uniforms (no process-wide matrices)
+struct Uniforms
+{
+	Matrix ModelView;
+	Matrix Projection;
+	Matrix ViewPort;
+	Matrix MVP;              // ViewPort * Projection * ModelView, see update()
+	Vec3f light_dir;
+	Matrix Mshadow;          // object -> shadowbuffer screen
+	TGAImage* shadowbuffer;  // null : no shadows
+	float params[4];         // free per-draw parameters
+	int shading_rate;            // 1, 2 or 4 : fragment() once per rate x rate pixel block (varyings at its first covered pixel), coverage and depth stay per pixel
+	TGAImage* shading_rate_map;  // optional, GRAYSCALE, one rate per SHADING_TILE screen tile, overrides shading_rate
+	BlendMode blend;             // how fragments merge into the image, blended draws test depth but don't write it
+
+	Uniforms() : MVP(Matrix::identity(4)), shadowbuffer(nullptr), shading_rate(1), shading_rate_map(nullptr), blend(BLEND_NONE) { for (int i = 0; i < 4; i++) params[i] = 0; }
+	void update() { MVP = ViewPort * Projection * ModelView; }
+};
+
+const int MAX_VARYINGS = 16;
+const int SHADING_TILE = 16; // pixels per side of a shading_rate_map tile
+
+struct Instance
+{
+	Matrix transform; // object -> world, applied before ModelView
+	float params[4];  // free per-instance parameters (tint, ...) for the shader
+};
+
 struct IShader
 {
+	// varying : vertex() writes nvaryings floats per vertex into varying[nvert],
+	// triangle() interpolates them (perspective correct) and hands them to fragment()
+	int nvaryings;
+	float varying[3][MAX_VARYINGS];
+
+	// bound by the draw call
+	Model* model;
+	const Uniforms* uniforms;
+
+	IShader(int n = 0) : nvaryings(n), model(nullptr), uniforms(nullptr) {}
 	virtual ~IShader() {}
-	virtual Vec3f vertex(int iface, int nvert) = 0;
-	virtual bool fragment(Vec3f bar, TGAColor& color) = 0;
+	void bind(Model* m, const Uniforms* u) { model = m; uniforms = u; }
+	virtual void instance(const Instance&) {}       // called by draw_instanced() before the faces of each instance
+	virtual Vec4f vertex(int iface, int nvert) = 0; // returns homogeneous screen coords (before w divide)
+	virtual bool fragment(const float* interp, TGAColor& color) = 0;
+};
+
+// per-pixel record of the last color raster : the face and the interpolated varyings every visible
+// fragment was shaded with, depth stays in the zbuffer. when only lighting or material uniforms change,
+// relight() runs fragment() over it again instead of transforming and rasterizing the mesh
+class GBuffer
+{
+private:
+	int width_, height_, nvaryings_;
+	std::vector<int> faces_; // -1 : nothing covers the pixel
+	std::vector<float> varyings_;
+	// what the contents were rasterized from, see current()
+	Model* model_;
+	int lod_;
+	Matrix mvp_;
+
+public:
+	GBuffer(int width, int height, int nvaryings);
+	void clear();
+	void store(int x, int y, int face, const float* interp, int n);
+	void stamp(Model* model, const Matrix& mvp);
+	bool current(Model* model, const Matrix& mvp) const; // false : geometry or view changed, raster again
+	int face(int x, int y) const { return faces_[x + y * width_]; }
+	const float* varyings(int x, int y) const { return &varyings_[(x + y * width_) * nvaryings_]; }
+	int width() const { return width_; }
+	int height() const { return height_; }
+	int nvaryings() const { return nvaryings_; }
 };
 
 Vec3f barycentric(Vec3f A, Vec3f B, Vec3f C, Vec3f P);
@@ -26,5 +95,103 @@ void line(Vec2i p0, Vec2i p1, TGAImage& image, TGAColor color);
 
 void triangleLines(Vec2i p0, Vec2i p1, Vec2i p2, TGAImage& image, TGAColor color);
 
-void triangle(Vec3i* pts, IShader& shader, TGAImage& image, TGAImage& zbuffer);
+void triangle(Vec4f* pts, IShader& shader, TGAImage& image, TGAImage& zbuffer);
+
+// depth-only fast path (shadow maps, z-prepass) : writes zbuffer only
+void triangle(Vec4f* pts, TGAImage& zbuffer);
+
+// shades only fragments whose depth equals the zbuffer (after a depth prepass), no depth writes
+void triangle_zequal(Vec4f* pts, IShader& shader, TGAImage& image, TGAImage& zbuffer);
+
+// vertex + raster for faces [begin, end) of a bound shader, image == null draws depth only
+// transient buffers (z-prepass, instancing, wireframe) come from frame_arena(), see reset_frame()
+// zprepass : depth-only pass over front-to-back sorted clusters, then a z-equal color pass that shades
+// one fragment per pixel, the one a single pass would keep (same image, for unblended draws)
+// gbuffer : also records every shaded fragment for relight()
+void draw(IShader& shader, int begin, int end, TGAImage* image, TGAImage& zbuffer, bool zprepass = false, GBuffer* gbuffer = nullptr);
+
+// renders faces [begin, end) of a bound shader in horizontal bands of band_height rows straight into a
+// width x height RGB TGA file : faces are binned per band once, every band is rasterized into a small
+// color / depth buffer and handed to a TGAStreamWriter, which encodes it while the next band renders.
+// memory is the bands plus the transformed faces, whatever the image size. shading_rate_map is ignored
+// (band rows are not screen rows), keep band_height a multiple of 4 for coarse shading rates
+bool draw_streamed(IShader& shader, int begin, int end, int width, int height, int band_height, const char* filename);
+
+// adaptive shading rate : per SHADING_TILE tile of a finished frame, 4 where no two neighbouring pixels
+// differ by more than threshold (luma, 0..255), 2 up to 4 x threshold, 1 elsewhere.
+// built from the previous frame, it makes the next one shade smooth regions coarsely
+void shading_rate_from(TGAImage& frame, TGAImage& rate_map, int threshold);
+
+// fragment() again for every pixel covered in gbuffer, one screen-space pass over rows spread on
+// nthreads workers (shaders[0..nthreads)). only valid for shaders whose varyings don't depend on
+// what changed, e.g. normals and uv with the lighting done in fragment()
+void relight(IShader** shaders, int nthreads, Model& model, const Uniforms& u, const GBuffer& gbuffer, TGAImage& image);
+
+template <class S>
+void relight(const S& shader, Model& model, const Uniforms& u, const GBuffer& gbuffer, TGAImage& image)
+{
+	int nthreads = worker_count();
+	S* copies = frame_arena().alloc<S>(nthreads);
+	IShader** shaders = frame_arena().alloc<IShader*>(nthreads);
+	for (int t = 0; t < nthreads; t++) shaders[t] = new (&copies[t]) S(shader);
+	relight(shaders, nthreads, model, u, gbuffer, image);
+	for (int t = 0; t < nthreads; t++) copies[t].~S();
+}
+
+// screen pixels covered by one object space unit around p (LOD selection)
+float pixels_per_unit(const Uniforms& u, const Matrix& object_to_view, Vec3f p);
+
+// one model, many transforms : the mesh is shared, instances are culled against the screen,
+// transformed once each into the frame arena, then rasterized band by band by nthreads workers,
+// each with its own shader (shaders[0..nthreads)). vertex() must leave all a face needs in varying
+// (instance() is called again before fragment() of an instance's faces)
+void draw_instanced(IShader** shaders, int nthreads, Model& model, const Uniforms& u, const Instance* instances, int ninstances, TGAImage& image, TGAImage& zbuffer);
+
+template <class S>
+void draw_instanced(const S& shader, Model& model, const Uniforms& u, const Instance* instances, int ninstances, TGAImage& image, TGAImage& zbuffer)
+{
+	// per-worker copies live in the frame arena
+	int nthreads = worker_count();
+	S* copies = frame_arena().alloc<S>(nthreads);
+	IShader** shaders = frame_arena().alloc<IShader*>(nthreads);
+	for (int t = 0; t < nthreads; t++) shaders[t] = new (&copies[t]) S(shader);
+	draw_instanced(shaders, nthreads, model, u, instances, ninstances, image, zbuffer);
+	for (int t = 0; t < nthreads; t++) copies[t].~S();
+}
+
+// model edges (shared ones drawn once) through object_to_screen, clipped and walked per screen band;
+// with a zbuffer from a previous fill it only draws the visible lines
+void wireframe(Model& model, const Matrix& object_to_screen, TGAImage& image, TGAColor color, TGAImage* zbuffer = nullptr);
+
+// recorded draws : targets, uniforms and draws are captured once and replayed by execute() every frame,
+// buffers can be recorded on any thread. replays on several threads at once are fine as long as they share
+// no shader object (it holds the varyings) and nobody calls set_lod() on a Model they draw meanwhile :
+// the active LOD is Model state, not part of the draw. run_workers() serves concurrent replays in turn
+class CommandBuffer
+{
+private:
+	enum Type { BIND_TARGET, CLEAR, SET_UNIFORMS, DRAW };
+	struct Command
+	{
+		Type type;
+		TGAImage* color;   // BIND_TARGET, null : depth only
+		TGAImage* depth;
+		GBuffer* gbuffer;  // optional, cleared along with depth
+		int index;         // SET_UNIFORMS : into uniforms_
+		Model* model;      // DRAW
+		IShader* shader;
+		int begin, end;    // DRAW face range, end < 0 : up to nfaces()
+		bool zprepass;
+		bool clear_color, clear_depth;
+	};
+	std::vector<Command> commands_;
+	std::vector<Uniforms> uniforms_;
 
+public:
+	void bind_target(TGAImage* color, TGAImage* depth, GBuffer* gbuffer = nullptr); // images may be views, e.g. one tile of an atlas
+	void clear(bool color = true, bool depth = true);
+	void set_uniforms(const Uniforms& u); // copied, MVP is updated here
+	void draw(Model* model, IShader* shader, int begin = 0, int end = -1, bool zprepass = false);
+	void reset();
+	void execute() const;
+};
\ No newline at end of file
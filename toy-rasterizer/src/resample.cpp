@@ -0,0 +1,192 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include "resample.h"
+#include "workers.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define RESAMPLE_SSE2
+#endif
+
+// pixels are widened to 4 floats (b, g, r, a) whatever the format, so one pixel is one SSE register
+static const int LANES = 4;
+static const int ROWS_PER_JOB = 8;
+
+static float filter_support(ResampleFilter filter)
+{
+	switch (filter)
+	{
+	case FILTER_BOX: return 0.5f;
+	case FILTER_BILINEAR: return 1.0f;
+	case FILTER_MITCHELL: return 2.0f;
+	default: return 3.0f;
+	}
+}
+
+static float sinc(float x)
+{
+	if (std::abs(x) < 1e-6f) return 1.0f;
+	x *= 3.14159265f;
+	return std::sin(x) / x;
+}
+
+static float filter_weight(ResampleFilter filter, float x)
+{
+	if (filter == FILTER_BOX) return x >= -0.5f && x < 0.5f ? 1.0f : 0.0f; // half open, ties go left
+	x = std::abs(x);
+	switch (filter)
+	{
+	case FILTER_BILINEAR:
+		return x < 1.0f ? 1.0f - x : 0.0f;
+	case FILTER_MITCHELL:
+	{
+		const float B = 1.0f / 3, C = 1.0f / 3;
+		if (x < 1.0f) return ((12 - 9 * B - 6 * C) * x * x * x + (-18 + 12 * B + 6 * C) * x * x + (6 - 2 * B)) / 6;
+		if (x < 2.0f) return ((-B - 6 * C) * x * x * x + (6 * B + 30 * C) * x * x + (-12 * B - 48 * C) * x + (8 * B + 24 * C)) / 6;
+		return 0.0f;
+	}
+	default:
+		return x < 3.0f ? sinc(x) * sinc(x / 3) : 0.0f;
+	}
+}
+
+// source samples [first, first + n) with weights[offset ..) make up one output sample
+struct Taps
+{
+	int first, n, offset;
+};
+
+static void build_taps(int src, int dst, ResampleFilter filter, std::vector<Taps>& taps, std::vector<float>& weights)
+{
+	float ratio = (float)src / dst;
+	float scale = std::max(1.0f, ratio); // stretch the kernel when shrinking so it still covers every source pixel
+	float support = filter_support(filter) * scale;
+	taps.resize(dst);
+	weights.clear();
+	for (int i = 0; i < dst; i++)
+	{
+		float center = (i + 0.5f) * ratio; // source pixel j sits at j + 0.5
+		int lo = std::max(0, (int)std::floor(center - support));
+		int hi = std::min(src - 1, (int)std::ceil(center + support));
+		Taps& t = taps[i];
+		t.offset = (int)weights.size();
+		float sum = 0;
+		for (int j = lo; j <= hi; j++)
+		{
+			float w = filter_weight(filter, (j + 0.5f - center) / scale);
+			weights.push_back(w);
+			sum += w;
+		}
+		if (sum <= 0)
+		{   // nothing under the kernel, fall back to the nearest pixel
+			weights.resize(t.offset);
+			weights.push_back(1.0f);
+			lo = hi = std::min(src - 1, (int)center);
+			sum = 1.0f;
+		}
+		// taps cut off at the border are renormalized so edges don't darken
+		for (int k = t.offset; k < (int)weights.size(); k++) weights[k] /= sum;
+		t.first = lo;
+		t.n = hi - lo + 1;
+	}
+}
+
+// out[i] += in[i] * w over n pixels
+static void accumulate(float* out, const float* in, float w, int n)
+{
+#ifdef RESAMPLE_SSE2
+	__m128 vw = _mm_set1_ps(w);
+	for (int i = 0; i < n; i++)
+	{
+		__m128 acc = _mm_loadu_ps(out + i * LANES);
+		acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(in + i * LANES), vw));
+		_mm_storeu_ps(out + i * LANES, acc);
+	}
+#else
+	for (int i = 0; i < n * LANES; i++) out[i] += in[i] * w;
+#endif
+}
+
+static void widen_row(const unsigned char* in, float* out, int n, int bpp, int stride)
+{
+	for (int i = 0; i < n; i++)
+	{
+		for (int c = 0; c < LANES; c++) out[i * LANES + c] = c < bpp ? in[i * stride + c] : 0.0f;
+	}
+}
+
+static void narrow_row(const float* in, unsigned char* out, int n, int bpp)
+{
+	for (int i = 0; i < n; i++)
+	{
+#ifdef RESAMPLE_SSE2
+		__m128i v = _mm_cvtps_epi32(_mm_loadu_ps(in + i * LANES)); // rounds to nearest
+		v = _mm_packs_epi32(v, v);
+		v = _mm_packus_epi16(v, v); // saturates to 0..255, Lanczos and Mitchell overshoot
+		unsigned int px = (unsigned int)_mm_cvtsi128_si32(v);
+		memcpy(out + i * bpp, &px, bpp);
+#else
+		for (int c = 0; c < bpp; c++)
+		{
+			float v = in[i * LANES + c] + 0.5f;
+			out[i * bpp + c] = (unsigned char)(v < 0 ? 0 : (v > 255 ? 255 : v));
+		}
+#endif
+	}
+}
+
+// rows [0, nrows) in chunks on every worker, each with its own scratch row of len floats
+template <class F>
+static void parallel_rows(int nrows, int len, F f)
+{
+	std::vector<std::vector<float>> scratch(worker_count(), std::vector<float>(len));
+	std::atomic<int> next(0);
+	auto job = [&](int t)
+	{
+		for (int first; (first = next.fetch_add(ROWS_PER_JOB)) < nrows;)
+		{
+			int last = std::min(nrows, first + ROWS_PER_JOB);
+			for (int y = first; y < last; y++) f(y, scratch[t].data());
+		}
+	};
+	run_workers(job);
+}
+
+TGAImage resample(TGAImage& src, int w, int h, ResampleFilter filter)
+{
+	const int sw = src.get_width(), sh = src.get_height(), bpp = src.get_bytespp();
+	if (w <= 0 || h <= 0 || sw <= 0 || sh <= 0 || !src.buffer()) return TGAImage();
+	TGAImage dst(w, h, bpp);
+
+	std::vector<Taps> xtaps, ytaps;
+	std::vector<float> xweights, yweights;
+	build_taps(sw, w, filter, xtaps, xweights);
+	build_taps(sh, h, filter, ytaps, yweights);
+
+	// horizontal : every source row -> w wide float row
+	std::vector<float> tmp((size_t)sh * w * LANES);
+	parallel_rows(sh, sw * LANES, [&](int y, float* row)
+	{
+		widen_row(src.pixel(0, y), row, sw, bpp, src.get_xstride()); // src may be a flipped or strided view
+		float* out = &tmp[(size_t)y * w * LANES];
+		memset(out, 0, sizeof(float) * w * LANES);
+		for (int x = 0; x < w; x++)
+		{
+			const Taps& t = xtaps[x];
+			for (int k = 0; k < t.n; k++) accumulate(out + x * LANES, row + (t.first + k) * LANES, xweights[t.offset + k], 1);
+		}
+	});
+
+	// vertical : whole rows at a time, contiguous so the SIMD loop streams
+	parallel_rows(h, w * LANES, [&](int y, float* row)
+	{
+		const Taps& t = ytaps[y];
+		memset(row, 0, sizeof(float) * w * LANES);
+		for (int k = 0; k < t.n; k++) accumulate(row, &tmp[(size_t)(t.first + k) * w * LANES], yweights[t.offset + k], w);
+		narrow_row(row, dst.pixel(0, y), w, bpp);
+	});
+	return dst;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "tgaimage.h"
+
+enum ResampleFilter
+{
+	FILTER_BOX,      // area average, cheapest proper downsample
+	FILTER_BILINEAR, // tent
+	FILTER_MITCHELL, // cubic, B = C = 1/3
+	FILTER_LANCZOS3  // windowed sinc, sharpest, may ring a little
+};
+
+// filtered resize of src into a new w x h image of the same format, an empty image if either is empty.
+// separable : weights are precomputed once per output column and row, then a horizontal
+// and a vertical pass run over row ranges on the worker threads.
+// unlike TGAImage::scale() (nearest, in place) every source pixel contributes when shrinking
+TGAImage resample(TGAImage& src, int w, int h, ResampleFilter filter = FILTER_LANCZOS3);
@@ -0,0 +1,266 @@
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <queue>
+#include <utility>
+#include "simplify.h"
+
+// symmetric 4x4 : sum of squared distances to a set of planes
+struct Quadric
+{
+	double q[10]; // aa ab ac ad bb bc bd cc cd dd
+
+	Quadric() { for (int i = 0; i < 10; i++) q[i] = 0; }
+	Quadric(double a, double b, double c, double d)
+	{
+		q[0] = a * a; q[1] = a * b; q[2] = a * c; q[3] = a * d;
+		q[4] = b * b; q[5] = b * c; q[6] = b * d;
+		q[7] = c * c; q[8] = c * d;
+		q[9] = d * d;
+	}
+	Quadric& operator+=(const Quadric& o)
+	{
+		for (int i = 0; i < 10; i++) q[i] += o.q[i];
+		return *this;
+	}
+	double error(const Vec3f& v) const
+	{
+		double x = v.x, y = v.y, z = v.z;
+		return q[0] * x * x + 2 * q[1] * x * y + 2 * q[2] * x * z + 2 * q[3] * x
+			+ q[4] * y * y + 2 * q[5] * y * z + 2 * q[6] * y
+			+ q[7] * z * z + 2 * q[8] * z
+			+ q[9];
+	}
+};
+
+struct Collapse
+{
+	double cost;
+	int from, to;
+	int stamp_from, stamp_to; // entry is stale once either vertex changed
+	bool operator<(const Collapse& c) const { return cost > c.cost; } // min-heap
+};
+
+static Vec3f face_normal(const Vec3f& a, const Vec3f& b, const Vec3f& c)
+{
+	return cross(b - a, c - a);
+}
+
+// distance from p to triangle abc : closest point by Voronoi region (Ericson, Real-Time Collision Detection 5.1.5)
+static float distance_to_triangle(const Vec3f& p, const Vec3f& a, const Vec3f& b, const Vec3f& c)
+{
+	Vec3f ab = b - a, ac = c - a, ap = p - a;
+	float d1 = ab * ap, d2 = ac * ap;
+	if (d1 <= 0 && d2 <= 0) return ap.norm();
+	Vec3f bp = p - b;
+	float d3 = ab * bp, d4 = ac * bp;
+	if (d3 >= 0 && d4 <= d3) return bp.norm();
+	float vc = d1 * d4 - d3 * d2;
+	if (vc <= 0 && d1 >= 0 && d3 <= 0) return (ap - ab * (d1 / (d1 - d3))).norm();
+	Vec3f cp = p - c;
+	float d5 = ab * cp, d6 = ac * cp;
+	if (d6 >= 0 && d5 <= d6) return cp.norm();
+	float vb = d5 * d2 - d1 * d6;
+	if (vb <= 0 && d2 >= 0 && d6 <= 0) return (ap - ac * (d2 / (d2 - d6))).norm();
+	float va = d3 * d6 - d5 * d4;
+	if (va <= 0 && d4 - d3 >= 0 && d5 - d6 >= 0) return (bp - (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)))).norm();
+	float denom = va + vb + vc;
+	if (denom <= 0) return std::min(ap.norm(), std::min(bp.norm(), cp.norm())); // degenerate
+	return (ap - ab * (vb / denom) - ac * (vc / denom)).norm();
+}
+
+std::vector<std::vector<Vec3i>> simplify(const std::vector<Vec3f>& verts, const std::vector<std::vector<Vec3i>>& faces, int target_faces, float& error)
+{
+	const int nv = (int)verts.size();
+	error = 0;
+
+	// working copy as triangles (fan split for polygons)
+	std::vector<std::vector<Vec3i>> tris;
+	for (int i = 0; i < (int)faces.size(); i++)
+	{
+		for (int k = 2; k < (int)faces[i].size(); k++)
+		{
+			std::vector<Vec3i> t;
+			t.push_back(faces[i][0]);
+			t.push_back(faces[i][k - 1]);
+			t.push_back(faces[i][k]);
+			tris.push_back(t);
+		}
+	}
+	const int nt = (int)tris.size();
+	std::vector<bool> dead(nt, false);
+	std::vector<std::vector<int>> vfaces(nv);
+	std::vector<Quadric> quadrics(nv);
+	std::vector<Vec3i> attr(nv, Vec3i(-1, -1, -1));
+	std::vector<bool> locked(nv, false);
+	std::map<std::pair<int, int>, int> edges;
+
+	for (int t = 0; t < nt; t++)
+	{
+		Vec3f a = verts[tris[t][0].ivert], b = verts[tris[t][1].ivert], c = verts[tris[t][2].ivert];
+		Vec3f n = face_normal(a, b, c);
+		float len = n.norm();
+		if (len > 0) n = n * (1.0f / len);
+		Quadric plane(n.x, n.y, n.z, -(n * a));
+		for (int k = 0; k < 3; k++)
+		{
+			Vec3i corner = tris[t][k];
+			int v = corner.ivert;
+			vfaces[v].push_back(t);
+			quadrics[v] += plane;
+			// one position with several uv/normal indices : seam or hard edge
+			if (attr[v].ivert < 0) attr[v] = corner;
+			else if (attr[v].iuv != corner.iuv || attr[v].inorm != corner.inorm) locked[v] = true;
+
+			int u = tris[t][(k + 1) % 3].ivert;
+			edges[std::make_pair(std::min(u, v), std::max(u, v))]++;
+		}
+	}
+	for (std::map<std::pair<int, int>, int>::iterator it = edges.begin(); it != edges.end(); ++it)
+	{
+		if (it->second == 1) locked[it->first.first] = locked[it->first.second] = true; // open boundary
+	}
+
+	std::vector<int> target(nv, -1); // vertex each collapsed one went to
+	std::vector<int> stamp(nv, 0);
+	std::priority_queue<Collapse> heap;
+	auto push_edges = [&](int v)
+	{
+		for (int i = 0; i < (int)vfaces[v].size(); i++)
+		{
+			int t = vfaces[v][i];
+			if (dead[t]) continue;
+			for (int k = 0; k < 3; k++)
+			{
+				int u = tris[t][k].ivert;
+				if (u == v) continue;
+				Quadric q = quadrics[v];
+				q += quadrics[u];
+				if (!locked[v])
+				{
+					Collapse c = { q.error(verts[u]), v, u, stamp[v], stamp[u] };
+					heap.push(c);
+				}
+				if (!locked[u])
+				{
+					Collapse c = { q.error(verts[v]), u, v, stamp[u], stamp[v] };
+					heap.push(c);
+				}
+			}
+		}
+	};
+	for (int v = 0; v < nv; v++) push_edges(v);
+
+	auto neighbours = [&](int v)
+	{
+		std::vector<int> n;
+		for (int i = 0; i < (int)vfaces[v].size(); i++)
+		{
+			int t = vfaces[v][i];
+			if (dead[t]) continue;
+			for (int k = 0; k < 3; k++)
+			{
+				if (tris[t][k].ivert != v) n.push_back(tris[t][k].ivert);
+			}
+		}
+		std::sort(n.begin(), n.end());
+		n.erase(std::unique(n.begin(), n.end()), n.end());
+		return n;
+	};
+
+	int alive = nt;
+	while (alive > target_faces && !heap.empty())
+	{
+		Collapse c = heap.top();
+		heap.pop();
+		int a = c.from, b = c.to;
+		if (c.stamp_from != stamp[a] || c.stamp_to != stamp[b] || locked[a]) continue;
+
+		// link condition : a and b may only share the neighbours of the faces on edge ab
+		std::vector<int> na = neighbours(a), nb = neighbours(b), common;
+		std::set_intersection(na.begin(), na.end(), nb.begin(), nb.end(), std::back_inserter(common));
+		int nshared = 0;
+		Vec3i battr(-1, -1, -1);
+		bool flips = false;
+		for (int i = 0; i < (int)vfaces[a].size() && !flips; i++)
+		{
+			int t = vfaces[a][i];
+			if (dead[t]) continue;
+			int ka = -1, kb = -1;
+			for (int k = 0; k < 3; k++)
+			{
+				if (tris[t][k].ivert == a) ka = k;
+				if (tris[t][k].ivert == b) kb = k;
+			}
+			if (kb >= 0)
+			{   // face on the edge : b's corner here lies on a's side of any seam
+				nshared++;
+				battr = tris[t][kb];
+				continue;
+			}
+			Vec3f p[3];
+			for (int k = 0; k < 3; k++) p[k] = verts[tris[t][k].ivert];
+			Vec3f before = face_normal(p[0], p[1], p[2]);
+			p[ka] = verts[b];
+			Vec3f after = face_normal(p[0], p[1], p[2]);
+			flips = before * after <= 0;
+		}
+		if (flips || nshared == 0 || (int)common.size() != nshared) continue;
+
+		for (int i = 0; i < (int)vfaces[a].size(); i++)
+		{
+			int t = vfaces[a][i];
+			if (dead[t]) continue;
+			bool on_edge = false;
+			for (int k = 0; k < 3; k++) on_edge = on_edge || tris[t][k].ivert == b;
+			if (on_edge)
+			{
+				dead[t] = true;
+				alive--;
+				continue;
+			}
+			for (int k = 0; k < 3; k++)
+			{
+				if (tris[t][k].ivert == a) tris[t][k] = battr;
+			}
+			vfaces[b].push_back(t);
+		}
+		vfaces[a].clear();
+		locked[a] = true;
+		quadrics[b] += quadrics[a];
+		stamp[a]++;
+		stamp[b]++;
+		target[a] = b;
+
+		std::vector<int>& fb = vfaces[b];
+		fb.erase(std::remove_if(fb.begin(), fb.end(), [&](int t) { return dead[t]; }), fb.end());
+		push_edges(b);
+	}
+
+	// geometric error : every collapsed vertex against the faces around the one it ended up in.
+	// the true nearest point may lie elsewhere, so this bounds the distance to the surface from above
+	for (int v = 0; v < nv; v++)
+	{
+		if (target[v] < 0) continue;
+		int r = target[v];
+		while (target[r] >= 0) r = target[r];
+		float d = std::numeric_limits<float>::max();
+		for (int i = 0; i < (int)vfaces[r].size(); i++)
+		{
+			if (dead[vfaces[r][i]]) continue;
+			const std::vector<Vec3i>& t = tris[vfaces[r][i]];
+			d = std::min(d, distance_to_triangle(verts[v], verts[t[0].ivert], verts[t[1].ivert], verts[t[2].ivert]));
+		}
+		if (d == std::numeric_limits<float>::max()) d = (verts[v] - verts[r]).norm(); // r lost every face
+		error = std::max(error, d);
+	}
+
+	std::vector<std::vector<Vec3i>> res;
+	for (int t = 0; t < nt; t++)
+	{
+		if (!dead[t]) res.push_back(tris[t]);
+	}
+	return res;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <vector>
+#include "geometry.h"
+
+// quadric error metric edge collapse (Garland & Heckbert) on a v/vt/vn face list as Model stores it.
+// a vertex only ever collapses onto a neighbour, so the survivors keep their uv and normal exactly;
+// vertices on uv seams, hard normal edges or open boundaries never move.
+// quadrics order the collapses; error receives a bound on how far any removed vertex lies from the
+// simplified surface (object units)
+std::vector<std::vector<Vec3i>> simplify(const std::vector<Vec3f>& verts, const std::vector<std::vector<Vec3i>>& faces, int target_faces, float& error);
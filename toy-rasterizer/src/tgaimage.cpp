@@ -1,47 +1,100 @@
+#include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <math.h>
 #include "tgaimage.h"
 
-TGAImage::TGAImage() : data(NULL), width(0), height(0), bytespp(0) {
+TGAImage::TGAImage() : data(NULL), width(0), height(0), bytespp(0), xstride(0), ystride(0) {
 }
 
-TGAImage::TGAImage(int w, int h, int bpp) : data(NULL), width(w), height(h), bytespp(bpp) {
+TGAImage::TGAImage(int w, int h, int bpp) : data(NULL), width(w), height(h), bytespp(bpp), xstride(bpp), ystride(w * bpp) {
 	unsigned long nbytes = width * height * bytespp;
-	data = new unsigned char[nbytes];
+	storage.reset(new unsigned char[nbytes], std::default_delete<unsigned char[]>());
+	data = storage.get();
 	memset(data, 0, nbytes);
 }
 
-TGAImage::TGAImage(const TGAImage& img) {
+TGAImage::TGAImage(const TGAImage& img) : data(NULL), width(0), height(0), bytespp(0), xstride(0), ystride(0) {
+	copy_from(img);
+}
+
+TGAImage::TGAImage(TGAImage&& img) : storage(std::move(img.storage)), data(img.data), width(img.width), height(img.height),
+	bytespp(img.bytespp), xstride(img.xstride), ystride(img.ystride) {
+	img.data = NULL;
+	img.width = img.height = 0;
+}
+
+TGAImage::TGAImage(const TGAImage& img, unsigned char* origin, int w, int h, int xs, int ys) : storage(img.storage), data(origin),
+	width(w), height(h), bytespp(img.bytespp), xstride(xs), ystride(ys) {
+}
+
+TGAImage::~TGAImage() {
+}
+
+// deep : a compact buffer of img's pixels, whatever view of its buffer img is
+void TGAImage::copy_from(const TGAImage& img) {
 	width = img.width;
 	height = img.height;
 	bytespp = img.bytespp;
+	xstride = bytespp;
+	ystride = width * bytespp;
+	storage.reset();
+	data = NULL;
+	if (!img.data || width <= 0 || height <= 0) return;
 	unsigned long nbytes = width * height * bytespp;
-	data = new unsigned char[nbytes];
-	memcpy(data, img.data, nbytes);
+	storage.reset(new unsigned char[nbytes], std::default_delete<unsigned char[]>());
+	data = storage.get();
+	for (int j = 0; j < height; j++) {
+		const unsigned char* src = img.data + j * img.ystride;
+		if (img.xstride == bytespp) memcpy(data + j * ystride, src, width * bytespp);
+		else for (int i = 0; i < width; i++) memcpy(data + j * ystride + i * bytespp, src + i * img.xstride, bytespp);
+	}
 }
 
-TGAImage::~TGAImage() {
-	if (data) delete[] data;
+TGAImage& TGAImage::operator =(const TGAImage& img) {
+	if (this != &img) copy_from(img);
+	return *this;
 }
 
-TGAImage& TGAImage::operator =(const TGAImage& img) {
+TGAImage& TGAImage::operator =(TGAImage&& img) {
 	if (this != &img) {
-		if (data) delete[] data;
+		storage = std::move(img.storage);
+		data = img.data;
 		width = img.width;
 		height = img.height;
 		bytespp = img.bytespp;
-		unsigned long nbytes = width * height * bytespp;
-		data = new unsigned char[nbytes];
-		memcpy(data, img.data, nbytes);
+		xstride = img.xstride;
+		ystride = img.ystride;
+		img.data = NULL;
+		img.width = img.height = 0;
 	}
 	return *this;
 }
 
+TGAImage TGAImage::view(int x, int y, int w, int h, int stepx, int stepy) {
+	// clamp to this view, an empty result has no pixels
+	if (stepx <= 0 || stepy <= 0) return TGAImage();
+	x = std::max(0, x);
+	y = std::max(0, y);
+	w = std::max(0, std::min(w, (width - x + stepx - 1) / stepx));
+	h = std::max(0, std::min(h, (height - y + stepy - 1) / stepy));
+	if (!data || !w || !h) return TGAImage();
+	return TGAImage(*this, pixel(x, y), w, h, xstride * stepx, ystride * stepy);
+}
+
+TGAImage TGAImage::clone() {
+	TGAImage img(width, height, bytespp);
+	for (int j = 0; j < height; j++) {
+		for (int i = 0; i < width; i++) memcpy(img.pixel(i, j), pixel(i, j), bytespp);
+	}
+	return img;
+}
+
 bool TGAImage::read_tga_file(const char* filename) {
-	if (data) delete[] data;
+	storage.reset();
 	data = NULL;
 	std::ifstream in;
 	in.open(filename, std::ios::binary);
@@ -66,7 +119,10 @@ bool TGAImage::read_tga_file(const char* filename) {
 		return false;
 	}
 	unsigned long nbytes = bytespp * width * height;
-	data = new unsigned char[nbytes];
+	storage.reset(new unsigned char[nbytes], std::default_delete<unsigned char[]>());
+	data = storage.get();
+	xstride = bytespp;
+	ystride = width * bytespp;
 	if (3 == header.datatypecode || 2 == header.datatypecode) {
 		in.read((char*)data, nbytes);
 		if (!in.good()) {
@@ -87,6 +143,7 @@ bool TGAImage::read_tga_file(const char* filename) {
 		std::cerr << "unknown file format " << (int)header.datatypecode << "\n";
 		return false;
 	}
+	// pixels stay in file order, the origin bits only set up the strides
 	if (!(header.imagedescriptor & 0x20)) {
 		flip_vertically();
 	}
@@ -148,10 +205,64 @@ bool TGAImage::load_rle_data(std::ifstream& in) {
 	return true;
 }
 
-bool TGAImage::write_tga_file(const char* filename, bool rle) {
+// TODO: it is not necessary to break a raw chunk for two equal pixels (for the matter of the resulting size)
+// one scanline at a time, packets never cross rows
+static bool unload_rle_data(std::ofstream& out, const unsigned char* pixels, int npixels, int bytespp) {
+	const unsigned char max_chunk_length = 128;
+	unsigned long curpix = 0;
+	while (curpix < (unsigned long)npixels) {
+		unsigned long chunkstart = curpix * bytespp;
+		unsigned long curbyte = curpix * bytespp;
+		unsigned char run_length = 1;
+		bool raw = true;
+		while (curpix + run_length < (unsigned long)npixels && run_length < max_chunk_length) {
+			bool succ_eq = true;
+			for (int t = 0; succ_eq && t < bytespp; t++) {
+				succ_eq = (pixels[curbyte + t] == pixels[curbyte + t + bytespp]);
+			}
+			curbyte += bytespp;
+			if (1 == run_length) {
+				raw = !succ_eq;
+			}
+			if (raw && succ_eq) {
+				run_length--;
+				break;
+			}
+			if (!raw && !succ_eq) {
+				break;
+			}
+			run_length++;
+		}
+		curpix += run_length;
+		out.put(raw ? run_length - 1 : run_length + 127);
+		if (!out.good()) {
+			std::cerr << "can't dump the tga file\n";
+			return false;
+		}
+		out.write((char*)(pixels + chunkstart), (raw ? run_length * bytespp : bytespp));
+		if (!out.good()) {
+			std::cerr << "can't dump the tga file\n";
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool write_footer(std::ofstream& out) {
 	unsigned char developer_area_ref[4] = { 0, 0, 0, 0 };
 	unsigned char extension_area_ref[4] = { 0, 0, 0, 0 };
 	unsigned char footer[18] = { 'T','R','U','E','V','I','S','I','O','N','-','X','F','I','L','E','.','\0' };
+	out.write((char*)developer_area_ref, sizeof(developer_area_ref));
+	out.write((char*)extension_area_ref, sizeof(extension_area_ref));
+	out.write((char*)footer, sizeof(footer));
+	if (!out.good()) {
+		std::cerr << "can't dump the tga file\n";
+		return false;
+	}
+	return true;
+}
+
+bool TGAImage::write_tga_file(const char* filename, bool rle) {
 	std::ofstream out;
 	out.open(filename, std::ios::binary);
 	if (!out.is_open()) {
@@ -165,43 +276,35 @@ bool TGAImage::write_tga_file(const char* filename, bool rle) {
 	header.width = width;
 	header.height = height;
 	header.datatypecode = (bytespp == GRAYSCALE ? (rle ? 11 : 3) : (rle ? 10 : 2));
-	header.imagedescriptor = 0x20; // top-left origin
+	// rows and pixels go out in memory order, the origin bits tell the reader how they are laid out
+	header.imagedescriptor = (ystride < 0 ? 0 : 0x20) | (xstride < 0 ? 0x10 : 0);
 	out.write((char*)&header, sizeof(header));
 	if (!out.good()) {
 		out.close();
 		std::cerr << "can't dump the tga file\n";
 		return false;
 	}
-	if (!rle) {
-		out.write((char*)data, width * height * bytespp);
-		if (!out.good()) {
-			std::cerr << "can't unload raw data\n";
-			out.close();
-			return false;
+	unsigned char* scratch = std::abs(xstride) == bytespp ? NULL : new unsigned char[width * bytespp];
+	for (int r = 0; r < height; r++) {
+		const unsigned char* row = file_row(r, scratch);
+		if (!rle) {
+			out.write((char*)row, width * bytespp);
+			if (!out.good()) {
+				std::cerr << "can't unload raw data\n";
+				break;
+			}
 		}
-	}
-	else {
-		if (!unload_rle_data(out)) {
-			out.close();
+		else if (!unload_rle_data(out, row, width, bytespp)) {
 			std::cerr << "can't unload rle data\n";
-			return false;
+			break;
 		}
 	}
-	out.write((char*)developer_area_ref, sizeof(developer_area_ref));
+	delete[] scratch;
 	if (!out.good()) {
-		std::cerr << "can't dump the tga file\n";
 		out.close();
 		return false;
 	}
-	out.write((char*)extension_area_ref, sizeof(extension_area_ref));
-	if (!out.good()) {
-		std::cerr << "can't dump the tga file\n";
-		out.close();
-		return false;
-	}
-	out.write((char*)footer, sizeof(footer));
-	if (!out.good()) {
-		std::cerr << "can't dump the tga file\n";
+	if (!write_footer(out)) {
 		out.close();
 		return false;
 	}
@@ -209,61 +312,27 @@ bool TGAImage::write_tga_file(const char* filename, bool rle) {
 	return true;
 }
 
-// TODO: it is not necessary to break a raw chunk for two equal pixels (for the matter of the resulting size)
-bool TGAImage::unload_rle_data(std::ofstream& out) {
-	const unsigned char max_chunk_length = 128;
-	unsigned long npixels = width * height;
-	unsigned long curpix = 0;
-	while (curpix < npixels) {
-		unsigned long chunkstart = curpix * bytespp;
-		unsigned long curbyte = curpix * bytespp;
-		unsigned char run_length = 1;
-		bool raw = true;
-		while (curpix + run_length < npixels && run_length < max_chunk_length) {
-			bool succ_eq = true;
-			for (int t = 0; succ_eq && t < bytespp; t++) {
-				succ_eq = (data[curbyte + t] == data[curbyte + t + bytespp]);
-			}
-			curbyte += bytespp;
-			if (1 == run_length) {
-				raw = !succ_eq;
-			}
-			if (raw && succ_eq) {
-				run_length--;
-				break;
-			}
-			if (!raw && !succ_eq) {
-				break;
-			}
-			run_length++;
-		}
-		curpix += run_length;
-		out.put(raw ? run_length - 1 : run_length + 127);
-		if (!out.good()) {
-			std::cerr << "can't dump the tga file\n";
-			return false;
-		}
-		out.write((char*)(data + chunkstart), (raw ? run_length * bytespp : bytespp));
-		if (!out.good()) {
-			std::cerr << "can't dump the tga file\n";
-			return false;
-		}
-	}
-	return true;
+// r-th row as stored in the file : contiguous rows point straight into the buffer, strided ones are gathered
+const unsigned char* TGAImage::file_row(int r, unsigned char* scratch) {
+	int y = ystride < 0 ? height - 1 - r : r;
+	int x = xstride < 0 ? width - 1 : 0;
+	if (std::abs(xstride) == bytespp) return pixel(x, y);
+	for (int i = 0; i < width; i++) memcpy(scratch + i * bytespp, pixel(xstride < 0 ? width - 1 - i : i, y), bytespp);
+	return scratch;
 }
 
 TGAColor TGAImage::get(int x, int y) {
 	if (!data || x < 0 || y < 0 || x >= width || y >= height) {
 		return TGAColor();
 	}
-	return TGAColor(data + (x + y * width) * bytespp, bytespp);
+	return TGAColor(pixel(x, y), bytespp);
 }
 
 bool TGAImage::set(int x, int y, TGAColor c) {
 	if (!data || x < 0 || y < 0 || x >= width || y >= height) {
 		return false;
 	}
-	memcpy(data + (x + y * width) * bytespp, c.raw, bytespp);
+	memcpy(pixel(x, y), c.raw, bytespp);
 	return true;
 }
 
@@ -279,33 +348,25 @@ int TGAImage::get_height() {
 	return height;
 }
 
+int TGAImage::get_xstride() {
+	return xstride;
+}
+
+int TGAImage::get_ystride() {
+	return ystride;
+}
+
 bool TGAImage::flip_horizontally() {
 	if (!data) return false;
-	int half = width >> 1;
-	for (int i = 0; i < half; i++) {
-		for (int j = 0; j < height; j++) {
-			TGAColor c1 = get(i, j);
-			TGAColor c2 = get(width - 1 - i, j);
-			set(i, j, c2);
-			set(width - 1 - i, j, c1);
-		}
-	}
+	data = pixel(width - 1, 0);
+	xstride = -xstride;
 	return true;
 }
 
 bool TGAImage::flip_vertically() {
 	if (!data) return false;
-	unsigned long bytes_per_line = width * bytespp;
-	unsigned char* line = new unsigned char[bytes_per_line];
-	int half = height >> 1;
-	for (int j = 0; j < half; j++) {
-		unsigned long l1 = j * bytes_per_line;
-		unsigned long l2 = (height - 1 - j) * bytes_per_line;
-		memmove((void*)line, (void*)(data + l1), bytes_per_line);
-		memmove((void*)(data + l1), (void*)(data + l2), bytes_per_line);
-		memmove((void*)(data + l2), (void*)line, bytes_per_line);
-	}
-	delete[] line;
+	data = pixel(0, height - 1);
+	ystride = -ystride;
 	return true;
 }
 
@@ -314,32 +375,32 @@ unsigned char* TGAImage::buffer() {
 }
 
 void TGAImage::clear() {
-	memset((void*)data, 0, width * height * bytespp);
+	if (!data) return;
+	for (int j = 0; j < height; j++) {
+		if (std::abs(xstride) == bytespp) memset(pixel(xstride < 0 ? width - 1 : 0, j), 0, width * bytespp);
+		else for (int i = 0; i < width; i++) memset(pixel(i, j), 0, bytespp);
+	}
 }
 
 bool TGAImage::scale(int w, int h) {
 	if (w <= 0 || h <= 0 || !data) return false;
-	unsigned char* tdata = new unsigned char[w * h * bytespp];
+	TGAImage scaled(w, h, bytespp);
+	unsigned char* tdata = scaled.data;
 	int nscanline = 0;
-	int oscanline = 0;
 	int erry = 0;
 	unsigned long nlinebytes = w * bytespp;
-	unsigned long olinebytes = width * bytespp;
 	for (int j = 0; j < height; j++) {
 		int errx = width - w;
 		int nx = -bytespp;
-		int ox = -bytespp;
 		for (int i = 0; i < width; i++) {
-			ox += bytespp;
 			errx += w;
 			while (errx >= (int)width) {
 				errx -= width;
 				nx += bytespp;
-				memcpy(tdata + nscanline + nx, data + oscanline + ox, bytespp);
+				memcpy(tdata + nscanline + nx, pixel(i, j), bytespp);
 			}
 		}
 		erry += h;
-		oscanline += olinebytes;
 		while (erry >= (int)height) {
 			if (erry >= (int)height << 1) // it means we jump over a scanline
 				memcpy(tdata + nscanline + nlinebytes, tdata + nscanline, nlinebytes);
@@ -347,9 +408,108 @@ bool TGAImage::scale(int w, int h) {
 			nscanline += nlinebytes;
 		}
 	}
-	delete[] data;
-	data = tdata;
+	*this = scaled; // other views keep the old pixels
+	return true;
+}
+
+TGAStreamWriter::TGAStreamWriter() : width(0), height(0), bytespp(0), rle(true), rows_written(0), busy(false), quit(false), ok(false) {
+}
+
+TGAStreamWriter::~TGAStreamWriter() {
+	close();
+}
+
+bool TGAStreamWriter::open(const char* filename, int w, int h, int bpp, bool use_rle) {
+	close();
+	if (w <= 0 || h <= 0 || w > 0xffff || h > 0xffff) {
+		std::cerr << "tga can't hold " << w << "x" << h << " pixels\n";
+		return false;
+	}
+	out.open(filename, std::ios::binary);
+	if (!out.is_open()) {
+		std::cerr << "can't open file " << filename << "\n";
+		return false;
+	}
 	width = w;
 	height = h;
-	return true;
-}
\ No newline at end of file
+	bytespp = bpp;
+	rle = use_rle;
+	rows_written = 0;
+	TGA_Header header;
+	memset((void*)&header, 0, sizeof(header));
+	header.bitsperpixel = bytespp << 3;
+	header.width = width;
+	header.height = height;
+	header.datatypecode = (bytespp == TGAImage::GRAYSCALE ? (rle ? 11 : 3) : (rle ? 10 : 2));
+	header.imagedescriptor = 0; // bottom-left origin : rows arrive bottom up
+	out.write((char*)&header, sizeof(header));
+	ok = out.good();
+	quit = false;
+	busy = false;
+	encoder = std::thread(&TGAStreamWriter::run, this);
+	return ok;
+}
+
+bool TGAStreamWriter::append(TGAImage& rows) {
+	if (!encoder.joinable() || rows.get_width() != width || rows.get_bytespp() != bytespp) return false;
+	std::unique_lock<std::mutex> lock(mutex);
+	idle.wait(lock, [this]() { return !busy; });
+	pending = rows.view(0, 0, rows.get_width(), rows.get_height()); // shares the pixels, the caller leaves them alone until the next append()
+	busy = true;
+	work.notify_one();
+	return ok;
+}
+
+bool TGAStreamWriter::close() {
+	if (!encoder.joinable()) return ok;
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		idle.wait(lock, [this]() { return !busy; });
+		quit = true;
+	}
+	work.notify_one();
+	encoder.join();
+	if (rows_written != height) {
+		std::cerr << "tga stream closed after " << rows_written << " of " << height << " rows\n";
+		ok = false;
+	}
+	ok = write_footer(out) && ok;
+	out.close();
+	return ok;
+}
+
+void TGAStreamWriter::run() {
+	unsigned char* scratch = new unsigned char[width * bytespp];
+	for (;;) {
+		// ok and rows_written are read by append() / close() : worked on as copies, stored back under the lock
+		TGAImage rows;
+		bool good;
+		int written;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			work.wait(lock, [this]() { return busy || quit; });
+			if (!busy) break;
+			rows = std::move(pending);
+			good = ok;
+			written = rows_written;
+		}
+		for (int j = 0; j < rows.get_height() && good && written < height; j++, written++) {
+			const unsigned char* row = rows.pixel(0, j);
+			if (rows.get_xstride() != bytespp) {
+				for (int i = 0; i < width; i++) memcpy(scratch + i * bytespp, rows.pixel(i, j), bytespp);
+				row = scratch;
+			}
+			if (rle) good = unload_rle_data(out, row, width, bytespp);
+			else {
+				out.write((char*)row, width * bytespp);
+				good = out.good();
+			}
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		ok = good;
+		rows_written = written;
+		busy = false;
+		idle.notify_all();
+	}
+	delete[] scratch;
+}
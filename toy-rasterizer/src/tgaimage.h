@@ -2,6 +2,10 @@
 
 #include <fstream>
 #include <iostream>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
 
 #pragma pack(push, 1)
 struct TGA_Header
@@ -42,6 +46,7 @@ struct TGAColor
 		{
 			raw[i] = p[i];
 		}
+		if (bpp < 4) a = 255; // no alpha channel : opaque, blend modes see it as such
 	}
 	TGAColor(const unsigned char v) : val(0), bytespp(1)
 	{
@@ -58,45 +63,86 @@ struct TGAColor
 		}
 		return *this;
 	}
-	TGAColor& operator*(float intensity)
+	// r, g, b * intensity (clamped to [0, 1]) in 8 bit fixed point, two channels per multiply. alpha
+	// is kept : lighting darkens a color, it doesn't make it translucent. see color.h for the packed kernels
+	TGAColor operator*(float intensity) const
 	{
-		intensity = (intensity > 1.0f ? 1.0f : (intensity < 0.0f ? 0.0f : intensity));
-		for (int i = 0; i < 4; i++)
-		{
-			raw[i] = raw[i] * intensity;
-		}
-		return *this;
+		unsigned int s = (unsigned int)((intensity > 1.0f ? 1.0f : (intensity < 0.0f ? 0.0f : intensity)) * 256.0f + 0.5f);
+		TGAColor c(*this);
+		c.val = (((val & 0x00ff00ff) * s >> 8) & 0x00ff00ff) | (((val >> 8) & 0x000000ff) * s & 0x0000ff00) | (val & 0xff000000);
+		return c;
 	}
 
 };
 
+// an image is a view : width x height pixels somewhere in a shared buffer, addressed through
+// byte strides. copies, view() and the flips only move the origin / strides and share the pixels,
+// clone() makes an independent compact copy.
 class TGAImage {
 protected:
-	unsigned char* data;
+	std::shared_ptr<unsigned char> storage; // owned by every view of the same pixels
+	unsigned char* data; // pixel (0, 0) of this view
 	int width;
 	int height;
 	int bytespp;
+	int xstride; // bytes from a pixel to its right neighbour, negative once flipped horizontally
+	int ystride; // bytes from a row to the next one, negative once flipped vertically
 
+	TGAImage(const TGAImage& img, unsigned char* origin, int w, int h, int xs, int ys);
+	void   copy_from(const TGAImage& img);
 	bool   load_rle_data(std::ifstream& in);
-	bool unload_rle_data(std::ofstream& out);
+	const unsigned char* file_row(int r, unsigned char* scratch);
 public:
 	enum Format { GRAYSCALE = 1, RGB = 3, RGBA = 4 };
 
 	TGAImage();
 	TGAImage(int w, int h, int bpp);
-	TGAImage(const TGAImage& img);
+	TGAImage(const TGAImage& img); // deep, like clone() : only view() and the flips share pixels
+	TGAImage(TGAImage&& img);      // takes img's buffer (and view of it) over
 	bool read_tga_file(const char* filename);
 	bool write_tga_file(const char* filename, bool rle = true);
-	bool flip_horizontally();
-	bool flip_vertically();
+	bool flip_horizontally(); // O(1)
+	bool flip_vertically();   // O(1)
 	bool scale(int w, int h);
+	// w x h pixels starting at (x, y), taking every stepx-th column and stepy-th row (steps > 0). shares the buffer
+	TGAImage view(int x, int y, int w, int h, int stepx = 1, int stepy = 1);
+	TGAImage clone();
 	TGAColor get(int x, int y);
 	bool set(int x, int y, TGAColor c);
 	~TGAImage();
-	TGAImage& operator =(const TGAImage& img);
+	TGAImage& operator =(const TGAImage& img); // deep
+	TGAImage& operator =(TGAImage&& img);
 	int get_width();
 	int get_height();
 	int get_bytespp();
-	unsigned char* buffer();
+	int get_xstride();
+	int get_ystride();
+	unsigned char* pixel(int x, int y) { return data + x * xstride + y * ystride; } // no bounds check
+	unsigned char* buffer(); // pixel (0, 0), rows are get_ystride() bytes apart
 	void clear();
-};
\ No newline at end of file
+};
+
+// writes a TGA as its rows are produced, for images too big to hold at once. the file is bottom-left
+// origin, so the first row appended is the bottom one (y up, like the rasterizer's screen space).
+// encoding runs on its own thread : append() returns as soon as the previous rows are written out,
+// so rendering the next band into a second buffer overlaps with encoding this one
+class TGAStreamWriter {
+private:
+	std::ofstream out;
+	int width, height, bytespp;
+	bool rle;
+	int rows_written;
+	std::thread encoder;
+	std::mutex mutex;
+	std::condition_variable work, idle;
+	TGAImage pending; // rows handed to the encoder
+	bool busy, quit, ok;
+
+	void run();
+public:
+	TGAStreamWriter();
+	~TGAStreamWriter();
+	bool open(const char* filename, int w, int h, int bpp, bool rle = true);
+	bool append(TGAImage& rows); // rows keep their pixels until the next append() or close()
+	bool close(); // false if a write failed or fewer than h rows came in
+};
@@ -0,0 +1,207 @@
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "vtexture.h"
+
+// the TGA a cache was cut from, as it was then
+struct TextureSource
+{
+	int width, height, bytespp;
+	long long size, mtime;
+};
+
+// cache layout : header, then tiles row by row, every one tile * tile * bytespp (edge tiles padded)
+struct VirtualTextureHeader
+{
+	char magic[4];
+	int width, height, bytespp, tile;
+	TextureSource source; // all 0 : built without one, never stale
+};
+
+static const char VTC_MAGIC[4] = { 'V', 'T', 'C', '2' };
+
+// file stamp and TGA header fields, without decoding the image
+static bool read_source(const char* filename, TextureSource& source)
+{
+	struct stat st;
+	if (!filename || stat(filename, &st) != 0) return false;
+	std::ifstream in(filename, std::ios::binary);
+	unsigned char header[18];
+	in.read((char*)header, sizeof(header));
+	if (!in.good()) return false;
+	source.width = header[12] | header[13] << 8;
+	source.height = header[14] | header[15] << 8;
+	source.bytespp = header[16] >> 3;
+	source.size = (long long)st.st_size;
+	source.mtime = (long long)st.st_mtime;
+	return true;
+}
+
+VirtualTexture::VirtualTexture() : width_(0), height_(0), bytespp_(1), tile_(1), tiles_x_(0), tiles_y_(0), tile_bytes_(0), budget_(0), slots_(0), frame_(1), loaded_(0)
+{
+}
+
+VirtualTexture::~VirtualTexture()
+{
+}
+
+bool VirtualTexture::build(TGAImage& image, const char* cachefile, const char* source, int tile)
+{
+	if (!image.buffer() || tile <= 0) return false;
+	std::ofstream out(cachefile, std::ios::binary);
+	if (!out.is_open())
+	{
+		std::cerr << "can't write texture cache " << cachefile << std::endl;
+		return false;
+	}
+	VirtualTextureHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, VTC_MAGIC, sizeof(header.magic));
+	if (source) read_source(source, header.source);
+	header.width = image.get_width();
+	header.height = image.get_height();
+	header.bytespp = image.get_bytespp();
+	header.tile = tile;
+	out.write((char*)&header, sizeof(header));
+
+	const int bpp = header.bytespp;
+	std::vector<unsigned char> texels((size_t)tile * tile * bpp);
+	for (int ty = 0; ty * tile < header.height; ty++)
+	{
+		for (int tx = 0; tx * tile < header.width; tx++)
+		{
+			std::fill(texels.begin(), texels.end(), 0);
+			int w = std::min(tile, header.width - tx * tile), h = std::min(tile, header.height - ty * tile);
+			for (int y = 0; y < h; y++)
+			{
+				for (int x = 0; x < w; x++) memcpy(&texels[((size_t)y * tile + x) * bpp], image.pixel(tx * tile + x, ty * tile + y), bpp); // image may be a flipped view
+			}
+			out.write((char*)texels.data(), texels.size());
+		}
+	}
+	if (!out.good())
+	{
+		std::cerr << "can't write texture cache " << cachefile << std::endl;
+		return false;
+	}
+	std::cerr << "texture cache " << cachefile << " built, " << header.width << "x" << header.height << " in " << tile << " px tiles" << std::endl;
+	return true;
+}
+
+bool VirtualTexture::open(const char* cachefile, size_t budget_bytes, const char* source)
+{
+	file_.open(cachefile, std::ios::binary);
+	if (!file_.is_open()) return false;
+	VirtualTextureHeader header;
+	file_.read((char*)&header, sizeof(header));
+	if (!file_.good() || memcmp(header.magic, VTC_MAGIC, sizeof(header.magic)) || header.width <= 0 || header.height <= 0 || header.tile <= 0
+		|| (header.bytespp != TGAImage::GRAYSCALE && header.bytespp != TGAImage::RGB && header.bytespp != TGAImage::RGBA))
+	{
+		file_.close();
+		return false;
+	}
+	TextureSource now;
+	if (header.source.size && read_source(source, now) && (now.width != header.source.width || now.height != header.source.height
+		|| now.bytespp != header.source.bytespp || now.size != header.source.size || now.mtime != header.source.mtime))
+	{   // a missing source keeps the cache, there is nothing to rebuild it from
+		std::cerr << "texture cache " << cachefile << " is older than " << source << std::endl;
+		file_.close();
+		return false;
+	}
+	width_ = header.width;
+	height_ = header.height;
+	bytespp_ = header.bytespp;
+	tile_ = header.tile;
+	tiles_x_ = (width_ + tile_ - 1) / tile_;
+	tiles_y_ = (height_ + tile_ - 1) / tile_;
+	tile_bytes_ = (size_t)tile_ * tile_ * bytespp_;
+	budget_ = budget_bytes;
+
+	const int n = tiles();
+	resident_.reset(new std::atomic<unsigned char*>[n]);
+	used_.reset(new std::atomic<unsigned>[n]);
+	for (int i = 0; i < n; i++)
+	{
+		resident_[i].store(nullptr);
+		used_[i].store(0);
+	}
+	// everything a steady frame loop needs is allocated here, load() never allocates
+	slots_ = std::min((size_t)n, std::max((size_t)1, budget_ / tile_bytes_));
+	pool_.reset(new unsigned char[slots_ * tile_bytes_]);
+	free_.reserve(slots_);
+	for (size_t i = 0; i < slots_; i++) free_.push_back(pool_.get() + i * tile_bytes_);
+	order_.reserve(n);
+	feedback_.reserve(n);
+	std::cerr << "texture cache " << cachefile << " : " << width_ << "x" << height_ << ", " << n << " tiles, " << slots_ << " resident at most" << std::endl;
+	return true;
+}
+
+TGAColor VirtualTexture::load(int tile, int texel)
+{
+	std::lock_guard<std::mutex> lock(load_mutex_);
+	unsigned char* texels = resident_[tile].load(std::memory_order_relaxed);
+	if (texels) return TGAColor(texels + texel * bytespp_, bytespp_); // another thread got there first
+	if (free_.empty())
+	{   // every slot is taken and nothing can be evicted until end_frame() : this texel alone
+		unsigned char raw[4] = { 0, 0, 0, 0 };
+		file_.seekg((std::streamoff)sizeof(VirtualTextureHeader) + (std::streamoff)tile * tile_bytes_ + (std::streamoff)texel * bytespp_);
+		file_.read((char*)raw, bytespp_);
+		if (!file_.good()) file_.clear();
+		return TGAColor(raw, bytespp_);
+	}
+	texels = free_.back();
+	free_.pop_back();
+	file_.seekg((std::streamoff)sizeof(VirtualTextureHeader) + (std::streamoff)tile * tile_bytes_);
+	file_.read((char*)texels, tile_bytes_);
+	if (!file_.good())
+	{
+		file_.clear();
+		memset(texels, 0, tile_bytes_); // black rather than garbage, the tile stays resident
+	}
+	loaded_++;
+	resident_[tile].store(texels, std::memory_order_release);
+	return TGAColor(texels + texel * bytespp_, bytespp_);
+}
+
+VirtualTextureStats VirtualTexture::end_frame()
+{
+	VirtualTextureStats stats;
+	const unsigned frame = frame_.load(std::memory_order_relaxed);
+	stats.loaded = loaded_;
+	stats.evicted = 0;
+	stats.unpaged = 0;
+	feedback_.clear();
+	order_.clear();
+	for (int i = 0; i < tiles(); i++)
+	{
+		bool resident = resident_[i].load(std::memory_order_relaxed) != nullptr;
+		if (used_[i].load(std::memory_order_relaxed) == frame)
+		{
+			feedback_.push_back(i);
+			if (!resident) stats.unpaged++;
+		}
+		if (resident) order_.push_back(i);
+	}
+	stats.requested = (int)feedback_.size();
+
+	// least recently used first, never a tile of this frame : it is the working set. past the budget,
+	// and until the next frame has a free slot for every tile this one had to bring in
+	const size_t headroom = std::min(slots_, (size_t)(stats.loaded + stats.unpaged));
+	size_t resident_bytes = order_.size() * tile_bytes_;
+	std::sort(order_.begin(), order_.end(), [this](int a, int b) { return used_[a].load(std::memory_order_relaxed) < used_[b].load(std::memory_order_relaxed); });
+	for (int i = 0; i < (int)order_.size() && (resident_bytes > budget_ || free_.size() < headroom); i++)
+	{
+		int tile = order_[i];
+		if (used_[tile].load(std::memory_order_relaxed) == frame) break;
+		free_.push_back(resident_[tile].exchange(nullptr));
+		resident_bytes -= tile_bytes_;
+		stats.evicted++;
+	}
+	stats.resident = (int)(resident_bytes / tile_bytes_);
+	stats.resident_bytes = resident_bytes;
+	loaded_ = 0;
+	frame_.store(frame + 1, std::memory_order_relaxed);
+	return stats;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "geometry.h"
+#include "tgaimage.h"
+
+// what one frame asked of a VirtualTexture, see end_frame()
+struct VirtualTextureStats
+{
+	int requested;          // distinct tiles sampled
+	int loaded;             // of those, read from the cache file
+	int evicted;            // dropped afterwards to get back under the budget
+	int unpaged;            // sampled texel by texel from the file, no tile slot was free
+	int resident;           // tiles in memory once trimmed
+	size_t resident_bytes;
+};
+
+// a texture cut into tile x tile blocks in a cache file, read one tile at a time the first time
+// sample() touches it, so memory and load time follow what is visible rather than the size of the map.
+// residency is capped by a byte budget, least recently used tiles go first. eviction waits for
+// end_frame() : tiles never move under a frame, which keeps sample() lock-free once a tile is in.
+// every tile slot is allocated by open(). a frame that needs more tiles than the budget holds reads
+// the rest texel by texel from the file (slow, but no allocation), end_frame() frees slots for them
+class VirtualTexture
+{
+private:
+	std::ifstream file_;
+	std::mutex load_mutex_; // file_, free_ and loaded_, only taken on a miss
+	int width_, height_, bytespp_, tile_, tiles_x_, tiles_y_;
+	size_t tile_bytes_, budget_, slots_; // slots_ : tiles the budget holds
+	std::unique_ptr<std::atomic<unsigned char*>[]> resident_; // per tile, null : on disk only
+	std::unique_ptr<std::atomic<unsigned>[]> used_;           // per tile, last frame it was sampled in
+	std::unique_ptr<unsigned char[]> pool_;                   // slots_ tile buffers
+	std::vector<unsigned char*> free_;
+	std::vector<int> order_;     // end_frame() scratch
+	std::vector<int> feedback_;  // tiles sampled in the last finished frame
+	std::atomic<unsigned> frame_; // read by sample() on every thread, advanced by end_frame()
+	int loaded_;
+
+	TGAColor load(int tile, int texel);
+
+public:
+	VirtualTexture();
+	~VirtualTexture();
+
+	// cuts a decoded texture into cachefile, rows stay as in image (y up for uv). source, the TGA
+	// image was read from, is stamped into the header (dimensions, file size and time)
+	static bool build(TGAImage& image, const char* cachefile, const char* source = nullptr, int tile = 128);
+	// reads the header only, false if cachefile is missing, not a tile cache, or older than a
+	// source that has changed since build() : the caller rebuilds it
+	bool open(const char* cachefile, size_t budget_bytes, const char* source = nullptr);
+
+	// nearest texel, uv in [0, 1], same addressing as TGAImage::get() on the whole map
+	TGAColor sample(Vec2f uv)
+	{
+		int x = (int)(uv.x * width_), y = (int)(uv.y * height_);
+		if (x < 0 || y < 0 || x >= width_ || y >= height_) return TGAColor();
+		int tile = (y / tile_) * tiles_x_ + x / tile_;
+		int texel = (y % tile_) * tile_ + x % tile_;
+		unsigned char* texels = resident_[tile].load(std::memory_order_acquire);
+		unsigned frame = frame_.load(std::memory_order_relaxed);
+		if (used_[tile].load(std::memory_order_relaxed) != frame) used_[tile].store(frame, std::memory_order_relaxed); // feedback
+		if (!texels) return load(tile, texel);
+		return TGAColor(texels + texel * bytespp_, bytespp_);
+	}
+
+	// call between frames (no sample() running) : records the feedback, evicts down to the budget and
+	// frees as many slots as this frame had to load
+	VirtualTextureStats end_frame();
+	const std::vector<int>& feedback() const { return feedback_; }
+	int width() const { return width_; }
+	int height() const { return height_; }
+	int tiles() const { return tiles_x_ * tiles_y_; }
+};
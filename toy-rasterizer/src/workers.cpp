@@ -0,0 +1,92 @@
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "workers.h"
+
+int worker_count()
+{
+	return std::min(MAX_WORKERS, std::max(1, (int)std::thread::hardware_concurrency()));
+}
+
+// set while this thread runs a job, on the pool's threads and on the caller alike
+static thread_local bool in_job = false;
+
+// persistent workers, so the frame loop never creates threads : run() hands every worker
+// (the caller is worker 0) the same job and returns once all of them are done.
+// callers on several threads take turns, a job calling run() itself runs the nested job inline
+class WorkerPool
+{
+private:
+	std::vector<std::thread> threads_;
+	std::mutex run_mutex_; // one job in the pool at a time
+	std::mutex mutex_;
+	std::condition_variable wake_, done_;
+	void (*job_)(void*, int);
+	void* ctx_;
+	int generation_;
+	int pending_;
+	bool quit_;
+
+	void loop(int t)
+	{
+		int seen = 0;
+		for (;;)
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			wake_.wait(lock, [&]() { return quit_ || generation_ != seen; });
+			if (quit_) return;
+			seen = generation_;
+			lock.unlock();
+			in_job = true;
+			job_(ctx_, t);
+			in_job = false;
+			lock.lock();
+			if (--pending_ == 0) done_.notify_one();
+		}
+	}
+
+public:
+	WorkerPool(int n) : job_(nullptr), ctx_(nullptr), generation_(0), pending_(0), quit_(false)
+	{
+		for (int t = 1; t < n; t++) threads_.push_back(std::thread(&WorkerPool::loop, this, t));
+	}
+	~WorkerPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			quit_ = true;
+		}
+		wake_.notify_all();
+		for (std::thread& t : threads_) t.join();
+	}
+	void run(void (*job)(void*, int), void* ctx)
+	{
+		if (in_job)
+		{   // the pool is busy with the job we are part of : every worker index, one after the other
+			for (int t = 0; t <= (int)threads_.size(); t++) job(ctx, t);
+			return;
+		}
+		std::lock_guard<std::mutex> turn(run_mutex_);
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			job_ = job;
+			ctx_ = ctx;
+			pending_ = (int)threads_.size();
+			generation_++;
+		}
+		wake_.notify_all();
+		in_job = true;
+		job(ctx, 0);
+		in_job = false;
+		std::unique_lock<std::mutex> lock(mutex_);
+		done_.wait(lock, [&]() { return pending_ == 0; });
+	}
+};
+
+void run_workers(void (*job)(void*, int), void* ctx)
+{
+	static WorkerPool pool(worker_count());
+	pool.run(job, ctx);
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+const int MAX_WORKERS = 64;
+
+int worker_count();
+
+// job(ctx, t) on every worker t in [0, worker_count()), the caller is t = 0.
+// returns once all of them are done, the threads persist between calls.
+// concurrent callers are served one after the other; called from inside a job, the nested
+// job runs on the calling thread alone, for every t in turn
+void run_workers(void (*job)(void*, int), void* ctx);
+
+template <class F>
+void run_workers(F& f)
+{
+	run_workers([](void* ctx, int t) { (*(F*)ctx)(t); }, &f);
+}